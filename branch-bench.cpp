@@ -0,0 +1,177 @@
+/**
+ * Characterizes the branch predictor of the current machine, e.g., to decide
+ * whether branchless rewrites of hot filters pay off on a given CPU. Runs
+ * branch kernels with known periodicity, density, indirect target count and
+ * call depth and reports branches, mispredicts and cycles per iteration,
+ * followed by the predictor's effective history depth and the cost of a
+ * mispredict in cycles. See `make branch-bench`.
+ */
+#include "perf-macos.hpp"
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// https://www.youtube.com/watch?v=nXaxk27zwlk&t=2441s, improved version from
+// https://github.com/google/benchmark/blob/ba9a763def4eca056d03b1ece2946b2d4ef6dfcb/include/benchmark/benchmark.h#L326
+#define DoNotEliminate(x) asm volatile("" : : "r,m"(x) : "memory")
+
+constexpr size_t iterations = 1 << 20;
+constexpr unsigned int column_width = 15;
+
+/// Per iteration figures of a branch kernel
+struct Result {
+    long double branches;
+    long double misses;
+    long double cycles;
+};
+
+/**
+ * Runs kernel once to train the predictor, then measures a second run
+ */
+template<class F>
+Result measure(Perf::Counter &counter, const size_t n, F &&kernel) {
+    kernel();
+    counter.start();
+    kernel();
+    const auto measurement = counter.stop().averaged(n);
+    return {measurement.data.at(Perf::branch_instruction_retired), measurement.data.at(Perf::branch_misses_retired),
+            measurement.data.at(Perf::cycles)};
+}
+
+void print_header(const std::string &kernel, const std::string &parameter) {
+    std::cout << std::endl
+              << std::setw(column_width) << kernel << std::setw(column_width) << parameter << std::setw(column_width)
+              << "Branches" << std::setw(column_width) << "Misses" << std::setw(column_width) << "Cycles"
+              << std::endl;
+}
+
+void print_row(const std::string &kernel, const std::string &parameter, const Result &result) {
+    std::cout << std::setw(column_width) << kernel << std::setw(column_width) << parameter << std::setw(column_width)
+              << std::to_string(result.branches) << std::setw(column_width) << std::to_string(result.misses)
+              << std::setw(column_width) << std::to_string(result.cycles) << std::endl;
+}
+
+/// Conditional branch kernel, taken whenever pattern[i] is set
+Result conditional(Perf::Counter &counter, const std::vector<uint8_t> &pattern) {
+    return measure(counter, pattern.size(), [&] {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < pattern.size(); i++) {
+            // asm prevents if-conversion, i.e., forces an actual branch
+            if (pattern[i]) {
+                asm volatile("");
+                sum += i;
+            }
+        }
+        DoNotEliminate(sum);
+    });
+}
+
+/// Repeats a random bit sequence of length period
+std::vector<uint8_t> periodic_pattern(const size_t period, std::mt19937_64 &rng) {
+    std::vector<uint8_t> sequence(period);
+    for (auto &bit : sequence) bit = rng() & 1;
+
+    std::vector<uint8_t> pattern(iterations);
+    for (size_t i = 0; i < iterations; i++) pattern[i] = sequence[i % period];
+    return pattern;
+}
+
+/// Random bits that are set with probability density
+std::vector<uint8_t> random_pattern(const double density, std::mt19937_64 &rng) {
+    std::bernoulli_distribution distribution(density);
+    std::vector<uint8_t> pattern(iterations);
+    for (auto &bit : pattern) bit = distribution(rng);
+    return pattern;
+}
+
+template<size_t I>
+__attribute__((noinline)) uint64_t target(const uint64_t value) {
+    asm volatile("");
+    return value + I;
+}
+
+/// Indirect call kernel, calling targets[i] in each iteration
+Result indirect(Perf::Counter &counter, const std::vector<uint8_t> &targets) {
+    using Target = uint64_t (*)(uint64_t);
+    static const Target table[] = {target<0>,  target<1>,  target<2>,  target<3>,  target<4>,  target<5>,
+                                   target<6>,  target<7>,  target<8>,  target<9>,  target<10>, target<11>,
+                                   target<12>, target<13>, target<14>, target<15>};
+    return measure(counter, targets.size(), [&] {
+        uint64_t sum = 0;
+        for (const auto index : targets) sum = table[index & 15](sum);
+        DoNotEliminate(sum);
+    });
+}
+
+__attribute__((noinline)) uint64_t recurse(const size_t depth) {
+    if (depth == 0) return 0;
+    // Using the result prevents tail recursion elimination
+    const auto result = recurse(depth - 1);
+    DoNotEliminate(result);
+    return result + 1;
+}
+
+/// Return kernel, i.e., recursion of a given depth. Reported per return
+Result returns(Perf::Counter &counter, const size_t depth) {
+    const auto calls = iterations / depth;
+    return measure(counter, calls * depth, [&] {
+        for (size_t i = 0; i < calls; i++) DoNotEliminate(recurse(depth));
+    });
+}
+
+int main() {
+    Perf::set_thread_qos();
+    Perf::Counter counter({Perf::branch_instruction_retired, Perf::branch_misses_retired, Perf::cycles});
+    std::mt19937_64 rng(42);
+
+    // Periodic patterns: the longest period that is still predicted is the effective history depth
+    size_t history_depth = 0;
+    bool predicted = true;
+    print_header("Periodic", "Period");
+    for (size_t period = 2; period <= iterations / 16; period *= 2) {
+        const auto result = conditional(counter, periodic_pattern(period, rng));
+        print_row("periodic", std::to_string(period), result);
+        predicted &= result.misses < 0.05;
+        if (predicted) history_depth = period;
+    }
+
+    // Random patterns of increasing density
+    print_header("Density", "Taken [%]");
+    Result unpredictable{};
+    for (const auto density : {0.0, 0.01, 0.05, 0.1, 0.2, 0.3, 0.4, 0.5}) {
+        unpredictable = conditional(counter, random_pattern(density, rng));
+        print_row("random", std::to_string(static_cast<int>(density * 100)), unpredictable);
+    }
+    // Same amount of taken branches as the 50% random pattern, but trivially predictable
+    std::vector<uint8_t> alternating(iterations);
+    for (size_t i = 0; i < iterations; i++) alternating[i] = i & 1;
+    const auto predictable = conditional(counter, alternating);
+
+    // Indirect calls with an increasing amount of targets, cyclic and random order
+    print_header("Indirect", "Targets");
+    for (const size_t targets : {1, 2, 4, 8, 16}) {
+        std::vector<uint8_t> cyclic(iterations), random(iterations);
+        for (size_t i = 0; i < iterations; i++) {
+            cyclic[i] = i % targets;
+            random[i] = rng() % targets;
+        }
+        print_row("cyclic", std::to_string(targets), indirect(counter, cyclic));
+        print_row("random", std::to_string(targets), indirect(counter, random));
+    }
+
+    // Returns beyond the return stack buffer size mispredict
+    print_header("Returns", "Depth");
+    for (const size_t depth : {4, 8, 16, 24, 32, 48, 64, 128}) {
+        print_row("recursion", std::to_string(depth), returns(counter, depth));
+    }
+
+    const auto mispredict_cost =
+            (unpredictable.cycles - predictable.cycles) / (unpredictable.misses - predictable.misses);
+    std::cout << std::endl
+              << "Effective history depth [iterations]: " << history_depth << std::endl
+              << "Mispredict cost [cycles]: " << std::to_string(mispredict_cost) << std::endl;
+}
@@ -23,16 +23,60 @@
 #ifndef PERF_MACOS_HPP
 #define PERF_MACOS_HPP
 
+#include <algorithm>
+#include <alloca.h>
+#include <atomic>
+#include <charconv>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <pthread.h>
+#include <random>
+#include <spawn.h>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+#if defined(PERF_MACOS_XRAY) && !defined(PERF_MACOS_DISABLE)
+#include <cxxabi.h>
+#include <regex>
+#include <xray/xray_interface.h>
+#endif
+
+// Environment of spawned processes, not declared by unistd.h on macOS
+extern char **environ;
+
 /**
  * =====================
  *    Arch detection
@@ -67,6 +111,36 @@
 #define forceinline
 #endif
 
+/**
+ * =====================
+ *     Code markers
+ * =====================
+ */
+
+/**
+ * Record the address of the marked location in a Perf::CodeRange when
+ * executed, e.g., to hand a hot loop's machine code to Perf::Mca:
+ *
+ *   Perf::CodeRange range;
+ *   PERF_MACOS_CODE_BEGIN(range);
+ *   for (...) { ... }
+ *   PERF_MACOS_CODE_END(range);
+ *
+ * The range spans all code the compiler placed between the markers. Markers
+ * do not constrain code motion, i.e., inspect the range if in doubt. Empty
+ * with PERF_MACOS_DISABLE.
+ */
+#if defined(PERF_MACOS_DISABLE)
+#define PERF_MACOS_CODE_BEGIN(range) ((void) 0)
+#define PERF_MACOS_CODE_END(range) ((void) 0)
+#elif defined(CPU_X86_64)
+#define PERF_MACOS_CODE_BEGIN(range) asm volatile("lea 1f(%%rip), %0\n1:" : "=r"((range).begin))
+#define PERF_MACOS_CODE_END(range) asm volatile("1: lea 1b(%%rip), %0" : "=r"((range).end))
+#elif defined(CPU_ARM64)
+#define PERF_MACOS_CODE_BEGIN(range) asm volatile("adr %0, 1f\n1:" : "=r"((range).begin))
+#define PERF_MACOS_CODE_END(range) asm volatile("1: adr %0, 1b" : "=r"((range).end))
+#endif
+
 /**
  * ====================
  *   Helper Defines
@@ -102,6 +176,47 @@
     KPERF_FUNC(kpc_set_thread_counting, int, uint32_t)                                                                 \
     KPERF_FUNC(kperf_sample_get, int, int *)
 
+// Supported events: PERF_EVENT(identifier, event select | (umask << 8), human readable name)
+#ifdef CPU_X86_64
+#define PERF_EVENTS_LIST                                                                                               \
+    PERF_EVENT(instructions_retired, 0x00C0, "Instructions")                                                           \
+    PERF_EVENT(l1_misses, 0x01CB, "L1 misses")                                                                         \
+    PERF_EVENT(llc_misses, 0x412E, "LLC misses")                                                                       \
+    PERF_EVENT(branch_misses_retired, 0x00C5, "Branch misses")                                                         \
+    PERF_EVENT(cycles, 0x003C, "Cycles")                                                                               \
+    PERF_EVENT(branch_instruction_retired, 0x00C4, "Branches")                                                         \
+    PERF_EVENT(l2_misses, 0x04CB, "L2 misses")                                                                         \
+    PERF_EVENT(llc_references, 0x4F2E, "LLC references")                                                               \
+    PERF_EVENT(reference_cycles, 0x013C, "Reference cycles")                                                           \
+    PERF_EVENT(fp_arith_scalar_double, 0x01C7, "FP scalar dp")                                                         \
+    PERF_EVENT(fp_arith_scalar_single, 0x02C7, "FP scalar sp")                                                         \
+    PERF_EVENT(fp_arith_128b_packed_double, 0x04C7, "FP 128b dp")                                                      \
+    PERF_EVENT(fp_arith_128b_packed_single, 0x08C7, "FP 128b sp")                                                      \
+    PERF_EVENT(fp_arith_256b_packed_double, 0x10C7, "FP 256b dp")                                                      \
+    PERF_EVENT(fp_arith_256b_packed_single, 0x20C7, "FP 256b sp")                                                      \
+    PERF_EVENT(fp_arith_512b_packed_double, 0x40C7, "FP 512b dp")                                                      \
+    PERF_EVENT(fp_arith_512b_packed_single, 0x80C7, "FP 512b sp")                                                      \
+    PERF_EVENT(l2_lines_out_non_silent, 0x02F2, "L2 dirty evicts")                                                     \
+    PERF_EVENT(uops_executed_thread, 0x01B1, "Uops executed")                                                          \
+    PERF_EVENT(l1d_pend_miss_pending, 0x0148, "L1D pend misses")                                                      \
+    PERF_EVENT(cycle_activity_stalls_total, 0x04A3, "Stalls total")                                                    \
+    PERF_EVENT(cycle_activity_stalls_mem_any, 0x14A3, "Stalls mem")                                                    \
+    PERF_EVENT(cycle_activity_stalls_l1d_miss, 0x0CA3, "Stalls L1D miss")                                              \
+    PERF_EVENT(cycle_activity_stalls_l2_miss, 0x05A3, "Stalls L2 miss")                                                \
+    PERF_EVENT(cycle_activity_stalls_l3_miss, 0x06A3, "Stalls L3 miss")                                                \
+    PERF_EVENT(cycle_activity_cycles_mem_any, 0x10A3, "Cycles mem any")                                                \
+    PERF_EVENT(uops_dispatched_port_0, 0x01A1, "Uops port 0")                                                          \
+    PERF_EVENT(uops_dispatched_port_1, 0x02A1, "Uops port 1")                                                          \
+    PERF_EVENT(uops_dispatched_port_2, 0x04A1, "Uops port 2")                                                          \
+    PERF_EVENT(uops_dispatched_port_3, 0x08A1, "Uops port 3")                                                          \
+    PERF_EVENT(uops_dispatched_port_4, 0x10A1, "Uops port 4")                                                          \
+    PERF_EVENT(uops_dispatched_port_5, 0x20A1, "Uops port 5")                                                          \
+    PERF_EVENT(uops_dispatched_port_6, 0x40A1, "Uops port 6")                                                          \
+    PERF_EVENT(uops_dispatched_port_7, 0x80A1, "Uops port 7")
+#elif defined(CPU_ARM64)
+#error "arm64 not fully implemented"
+#endif
+
 #define PERF_ERROR(msg) throw std::runtime_error(msg ". Did you forget to run as root?")
 
 /**
@@ -110,22 +225,110 @@
  * ====================
  */
 namespace Perf {
-    enum Event {
-#ifdef CPU_X86_64
-        instructions_retired = 0x00C0,
-        l1_misses = 0x01CB,
-        llc_misses = 0x412E,
-        branch_misses_retired = 0x00C5,
-        cycles = 0x003C,
-        branch_instruction_retired = 0x00C4,
-        l2_misses = 0x04CB,
-        llc_references = 0x4F2E,
-        reference_cycles = 0x013C,
-#elif defined(CPU_ARM64)
-#error "arm64 not fully implemented"
-#endif
+    /**
+     * Events are identified by their 16 bit code. Modifiers, e.g., the
+     * privilege levels to count in, are stored above the code at their bit
+     * positions in the perf event select registers, see Perf::kernel_mode()
+     */
+    enum Event : uint32_t {
+#define PERF_EVENT(identifier, code, name) identifier = code,
+        PERF_EVENTS_LIST
+#undef PERF_EVENT
     };
 
+    /**
+     * - Intel 64 and IA-32 Architectures Software Developer's Manual, Volume 3, Section 18.2.1.1.
+     * - https://github.com/apple/darwin-xnu/blob/8f02f2a044b9bb1ad951987ef5bab20ec9486310/osfmk/x86_64/kpc_x86.c#L348
+     */
+    constexpr uint32_t INTEL_CONF_CTR_USER_MODE = 0x10000;
+    constexpr uint32_t INTEL_CONF_CTR_OS_MODE = 0x20000;
+    constexpr uint32_t INTEL_CONF_CTR_EDGE_DETECT = 0x40000;
+    constexpr uint32_t INTEL_CONF_CTR_INVERTED = 0x800000;
+    constexpr uint32_t INTEL_CONF_CTR_CMASK = 0xFF000000;
+
+    /// Event without any modifiers
+    constexpr Event base_event(const Event event) { return static_cast<Event>(event & 0xFFFF); }
+
+    /// Counts event in user mode (ring 3) only. This is the default for events without mode
+    constexpr Event user_mode(const Event event) {
+        return static_cast<Event>((event & ~INTEL_CONF_CTR_OS_MODE) | INTEL_CONF_CTR_USER_MODE);
+    }
+
+    /// Counts event in kernel mode (ring 0) only, e.g., syscalls and page faults
+    constexpr Event kernel_mode(const Event event) {
+        return static_cast<Event>((event & ~INTEL_CONF_CTR_USER_MODE) | INTEL_CONF_CTR_OS_MODE);
+    }
+
+    /// Counts event in both user and kernel mode
+    constexpr Event user_and_kernel_mode(const Event event) {
+        return static_cast<Event>(event | INTEL_CONF_CTR_USER_MODE | INTEL_CONF_CTR_OS_MODE);
+    }
+
+    /**
+     * Counts cycles in which the event occurred at least cmask times instead
+     * of occurrences, e.g., cycles with at least cmask outstanding L1D misses
+     */
+    constexpr Event counter_mask(const Event event, const uint8_t cmask) {
+        return static_cast<Event>((event & ~INTEL_CONF_CTR_CMASK) | (static_cast<uint32_t>(cmask) << 24));
+    }
+
+    /// Inverts the counter_mask() comparison, i.e., counts cycles with less than cmask occurrences
+    constexpr Event inverted(const Event event) { return static_cast<Event>(event | INTEL_CONF_CTR_INVERTED); }
+
+    /// Counts transitions into the counter_mask() condition instead of cycles, e.g., distinct stall episodes
+    constexpr Event edge_detect(const Event event) { return static_cast<Event>(event | INTEL_CONF_CTR_EDGE_DETECT); }
+
+    /// Whether event counts occurrences, i.e., has no counter_mask(), inverted() or edge_detect() modifier
+    constexpr bool counts_occurrences(const Event event) {
+        return (event & (INTEL_CONF_CTR_CMASK | INTEL_CONF_CTR_INVERTED | INTEL_CONF_CTR_EDGE_DETECT)) == 0;
+    }
+
+    /// Cycles in which no uops were executed, i.e., execution stall cycles
+    inline constexpr Event zero_uop_cycles = inverted(counter_mask(uops_executed_thread, 1));
+    /// Distinct execution stalls, i.e., transitions into zero_uop_cycles
+    inline constexpr Event stall_episodes = edge_detect(zero_uop_cycles);
+    /**
+     * Cycles with at least one outstanding L1D miss. Some CPUs, e.g.,
+     * Skylake, only count l1d_pend_miss_pending on the third register
+     */
+    inline constexpr Event l1d_pend_miss_cycles = counter_mask(l1d_pend_miss_pending, 1);
+
+    /// CYCLE_ACTIVITY events only count as documented with their umask as counter mask, e.g., stalls_total
+    constexpr Event cycle_activity(const Event event) { return counter_mask(event, (event >> 8) & 0xFF); }
+
+    /**
+     * Splits each event into its user mode and kernel mode variant, which
+     * Measurement::pretty_print() shows side by side. Note that this doubles
+     * the amount of required perf registers, see Perf::measure_grouped.
+     */
+    [[maybe_unused]] static std::vector<Event> split_modes(const std::vector<Event> &events) {
+        std::vector<Event> split;
+        for (const auto &event : events) {
+            split.push_back(user_mode(event));
+            split.push_back(kernel_mode(event));
+        }
+        return split;
+    }
+
+    /**
+     * All floating point arithmetic events. Required for vectorization metrics
+     * and roofline analysis. Note that these are more events than most CPUs
+     * have perf registers, see Perf::measure_grouped.
+     */
+    inline const std::vector<Event> fp_arith_events = {
+            fp_arith_scalar_double,      fp_arith_scalar_single,      fp_arith_128b_packed_double,
+            fp_arith_128b_packed_single, fp_arith_256b_packed_double, fp_arith_256b_packed_single,
+            fp_arith_512b_packed_double, fp_arith_512b_packed_single};
+
+    /**
+     * Uops dispatched to each execution port (UOPS_DISPATCHED_PORT, Haswell to
+     * Coffee Lake numbering). More events than most CPUs have perf registers,
+     * see Perf::measure_grouped.
+     */
+    inline const std::vector<Event> port_events = {
+            uops_dispatched_port_0, uops_dispatched_port_1, uops_dispatched_port_2, uops_dispatched_port_3,
+            uops_dispatched_port_4, uops_dispatched_port_5, uops_dispatched_port_6, uops_dispatched_port_7};
+
     /**
      * To ensure stable measurements, it is advisable to set thread quality
      * of service. Especially for big/little CPUs, this can help ensuring that
@@ -142,32 +345,214 @@ namespace Perf {
         pthread_set_qos_class_self_np(qos_class, 0);
     }
 
+    /**
+     * Modifier suffix of an event, e.g., ":k" for kernel mode, ":uk" for user
+     * and kernel mode or ":ec1" for edge detect with counter mask 1. Empty for
+     * events without modifiers
+     */
+    [[maybe_unused]] static std::string modifiers(const Event &event) {
+        std::string flags;
+        if (event & INTEL_CONF_CTR_USER_MODE) flags += 'u';
+        if (event & INTEL_CONF_CTR_OS_MODE) flags += 'k';
+        if (event & INTEL_CONF_CTR_EDGE_DETECT) flags += 'e';
+        if (event & INTEL_CONF_CTR_INVERTED) flags += 'i';
+        if (event & INTEL_CONF_CTR_CMASK) flags += "c" + std::to_string(event >> 24);
+        return flags.empty() ? flags : ":" + flags;
+    }
+
+    /**
+     * Human readable name of an event including its modifiers, e.g., for table headers
+     */
+    [[maybe_unused]] static std::string human_readable_name(const Event &event) {
+        switch (base_event(event)) {
+#define PERF_EVENT(identifier, code, name)                                                                             \
+    case identifier:                                                                                                   \
+        return name + modifiers(event);
+            PERF_EVENTS_LIST
+#undef PERF_EVENT
+            default:
+                return "Unimplemented";
+        }
+    }
+
+    /**
+     * Identifier of an event, i.e., its enumerator name such as "llc_misses"
+     * followed by its modifiers such as "llc_misses:k"
+     */
+    [[maybe_unused]] static std::string identifier(const Event &event) {
+        switch (base_event(event)) {
+#define PERF_EVENT(identifier, code, name)                                                                             \
+    case identifier:                                                                                                   \
+        return #identifier + modifiers(event);
+            PERF_EVENTS_LIST
+#undef PERF_EVENT
+            default:
+                char raw[32];
+                snprintf(raw, sizeof(raw), "event_0x%X", static_cast<unsigned int>(base_event(event)));
+                return raw + modifiers(event);
+        }
+    }
+
+    /**
+     * Parses an event from its identifier, see Perf::identifier()
+     *
+     * @throws std::invalid_argument for unknown identifiers or modifiers
+     */
+    [[maybe_unused]] static Event parse_event(const std::string &text) {
+        const auto separator = text.find(':');
+        const auto base = text.substr(0, separator);
+        const auto flags = separator == std::string::npos ? std::string() : text.substr(separator + 1);
+
+        uint32_t event = 0;
+#define PERF_EVENT(identifier, code, name)                                                                             \
+    if (base == #identifier) event = identifier;
+        PERF_EVENTS_LIST
+#undef PERF_EVENT
+        unsigned int raw;
+        if (event == 0 && sscanf(base.c_str(), "event_0x%X", &raw) == 1) event = raw;
+        if (event == 0) throw std::invalid_argument("Unknown perf event: " + text);
+
+        for (size_t i = 0; i < flags.size(); i++) {
+            switch (flags[i]) {
+                case 'u':
+                    event |= INTEL_CONF_CTR_USER_MODE;
+                    break;
+                case 'k':
+                    event |= INTEL_CONF_CTR_OS_MODE;
+                    break;
+                case 'e':
+                    event |= INTEL_CONF_CTR_EDGE_DETECT;
+                    break;
+                case 'i':
+                    event |= INTEL_CONF_CTR_INVERTED;
+                    break;
+                case 'c': {
+                    size_t digits = 0;
+                    while (i + 1 + digits < flags.size() && isdigit(flags[i + 1 + digits])) digits++;
+                    const auto cmask = digits == 0 ? 256 : std::stoul(flags.substr(i + 1, digits));
+                    if (cmask > 255) throw std::invalid_argument("Invalid perf event counter mask: " + text);
+                    event = counter_mask(static_cast<Event>(event), cmask);
+                    i += digits;
+                    break;
+                }
+                default:
+                    throw std::invalid_argument("Unknown perf event modifier: " + text);
+            }
+        }
+        return static_cast<Event>(event);
+    }
+
     /// A Perf::Measurement captures the values of perf hardware counters at a specific point in time
     template<class D = uint64_t>
     struct Measurement {
         const std::unordered_map<Event, D> data;
         const long double time_delta_ns;
+        /// Amount of pause() intervals excluded from this measurement, e.g., to subtract their overhead
+        const uint64_t pauses;
+
+        /// Counter deltas of a single Counter::lap()
+        struct Lap {
+            std::string name;
+            std::unordered_map<Event, D> data;
+            long double time_delta_ns;
+
+            Measurement measurement() const { return Measurement(data, time_delta_ns); }
+        };
+        /// Laps in order, empty if no laps were taken
+        const std::vector<Lap> laps;
 
-        Measurement(const std::unordered_map<Event, D> &data, const long double &time_delta_ns)
-            : data(data), time_delta_ns(time_delta_ns) {}
+        Measurement(const std::unordered_map<Event, D> &data, const long double &time_delta_ns,
+                    const uint64_t pauses = 0, const std::vector<Lap> &laps = {})
+            : data(data), time_delta_ns(time_delta_ns), pauses(pauses), laps(laps) {}
+
+        /// Empty measurement, i.e., no counter values and zero elapsed time
+        Measurement() : data(), time_delta_ns(0), pauses(0), laps() {}
 
         /**
          * Pretty print this measurement in a one-row table (with header).
+         * Measurements with laps are printed with one row per lap followed
+         * by the total.
          *
          * @param column_width width (in chars) of each table column
          */
         void pretty_print(unsigned int column_width = 15) const {
+            const auto vectorization = has_fp_arith();
+
+            const auto events = columns();
+
             // Table header
+            if (!laps.empty()) std::cout << std::setw(column_width) << "Lap";
             std::cout << std::setw(column_width) << "Elapsed [ns]";
-            for (const auto &it : data) { std::cout << std::setw(column_width) << human_readable_name(it.first); }
+            for (const auto &event : events) { std::cout << std::setw(column_width) << human_readable_name(event); }
+            if (vectorization) {
+                std::cout << std::setw(column_width) << "Vec ratio" << std::setw(column_width) << "Vec width [b]";
+            }
+            if (pauses > 0) std::cout << std::setw(column_width) << "Pauses";
             std::cout << std::endl;
 
-            // Table row
-            std::cout << std::setw(column_width) << std::to_string(time_delta_ns);
-            for (const auto &it : data) { std::cout << std::setw(column_width) << std::to_string(it.second); }
-            std::cout << std::endl;
+            // Table rows. Columns follow the total's order
+            for (const auto &lap : laps) {
+                std::cout << std::setw(column_width) << lap.name;
+                lap.measurement().print_row(column_width, events, vectorization, pauses > 0);
+            }
+            if (!laps.empty()) std::cout << std::setw(column_width) << "total";
+            print_row(column_width, events, vectorization, pauses > 0);
+        }
+
+        /**
+         * Share of packed (vector) instructions among all retired floating point
+         * arithmetic instructions. Requires the fp_arith_* events, see Perf::fp_arith_events.
+         *
+         * @return ratio within [0, 1], NaN if no floating point arithmetic was measured
+         */
+        long double vectorization_ratio() const {
+            long double packed = 0, total = 0;
+            for (const auto &[event, value] : data) {
+                const auto width = fp_arith_width(event);
+                if (width == 0) continue;
+                total += value;
+                if (width >= 128) packed += value;
+            }
+            return packed / total;
+        }
+
+        /**
+         * Average operand width in bits of all retired floating point arithmetic
+         * instructions, e.g., 64 for purely scalar double precision code and 256
+         * for fully AVX vectorized code. Requires the fp_arith_* events, see Perf::fp_arith_events.
+         *
+         * @return average width, NaN if no floating point arithmetic was measured
+         */
+        long double average_vector_width() const {
+            long double bits = 0, total = 0;
+            for (const auto &[event, value] : data) {
+                const auto width = fp_arith_width(event);
+                if (width == 0) continue;
+                total += value;
+                bits += static_cast<long double>(value) * width;
+            }
+            return bits / total;
         }
 
+        /**
+         * Memory-level parallelism, i.e., average amount of outstanding L1D
+         * misses in cycles with at least one outstanding miss. Low values
+         * in miss heavy loops indicate that misses are serialized, e.g., by
+         * dependent loads. Requires l1d_pend_miss_pending and Perf::l1d_pend_miss_cycles.
+         *
+         * @return average outstanding misses, NaN if not measured
+         */
+        long double memory_level_parallelism() const { return ratio(l1d_pend_miss_pending, l1d_pend_miss_cycles); }
+
+        /**
+         * Average length of an execution stall in cycles, i.e., whether stall
+         * cycles stem from few long (e.g., memory) or many short stalls.
+         * Requires Perf::zero_uop_cycles and Perf::stall_episodes.
+         *
+         * @return average stall cycles, NaN if not measured
+         */
+        long double average_stall_length() const { return ratio(zero_uop_cycles, stall_episodes); }
+
         /**
          * Divide each measured datapoint by N, effectively obtaining
          * an average figure for the benchmarked code within the N-step
@@ -176,42 +561,89 @@ namespace Perf {
          * @tparam T type of N, e.g., uint64_t
          * @tparam R result type, defaults to long double (precision)
          * @param N divisor, meant to be set to amount of iterations of the benchmark repeat loop
-         * @return
+         * @return averaged measurement. The amount of pauses is retained as is
          */
         template<class T, class R = long double>
         Measurement<R> averaged(const T &N) const {
             std::unordered_map<Event, R> new_data;
             for (const auto &it : data) { new_data.emplace(it.first, static_cast<R>(it.second) / static_cast<R>(N)); }
-            return Measurement<R>(new_data, time_delta_ns / static_cast<long double>(N));
+
+            std::vector<typename Measurement<R>::Lap> new_laps;
+            for (const auto &lap : laps) {
+                const auto averaged_lap = lap.measurement().template averaged<T, R>(N);
+                new_laps.push_back({lap.name, averaged_lap.data, averaged_lap.time_delta_ns});
+            }
+
+            return Measurement<R>(new_data, time_delta_ns / static_cast<long double>(N), pauses, new_laps);
         }
 
     private:
-        static std::string human_readable_name(const Event &event) {
-            switch (event) {
-                case instructions_retired:
-                    return "Instructions";
-                case l1_misses:
-                    return "L1 misses";
-                case llc_misses:
-                    return "LLC misses";
-                case branch_misses_retired:
-                    return "Branch misses";
-                case cycles:
-                    return "Cycles";
-                case branch_instruction_retired:
-                    return "Branches";
-                case l2_misses:
-                    return "L2 misses";
-                case llc_references:
-                    return "LLC misses";
-                case reference_cycles:
-                    return "Reference cycles";
+        /// Measured events in column order, i.e., variants of the same event (user and kernel mode) side by side
+        std::vector<Event> columns() const {
+            std::vector<Event> events;
+            std::unordered_map<uint32_t, size_t> rank;
+            for (const auto &it : data) {
+                events.push_back(it.first);
+                rank.emplace(base_event(it.first), rank.size());
+            }
+            std::stable_sort(events.begin(), events.end(), [&](const Event &a, const Event &b) {
+                return std::make_pair(rank[base_event(a)], a) < std::make_pair(rank[base_event(b)], b);
+            });
+            return events;
+        }
+
+        void print_row(const unsigned int column_width, const std::vector<Event> &events, const bool vectorization,
+                       const bool show_pauses) const {
+            std::cout << std::setw(column_width) << std::to_string(time_delta_ns);
+            for (const auto &event : events) {
+                const auto value = data.find(event);
+                std::cout << std::setw(column_width) << (value == data.end() ? "-" : std::to_string(value->second));
+            }
+            if (vectorization) {
+                std::cout << std::setw(column_width) << std::to_string(vectorization_ratio())
+                          << std::setw(column_width) << std::to_string(average_vector_width());
+            }
+            if (show_pauses) std::cout << std::setw(column_width) << std::to_string(pauses);
+            std::cout << std::endl;
+        }
+
+        long double ratio(const Event &numerator, const Event &denominator) const {
+            const auto n = data.find(numerator), d = data.find(denominator);
+            if (n == data.end() || d == data.end()) return std::numeric_limits<long double>::quiet_NaN();
+            return static_cast<long double>(n->second) / static_cast<long double>(d->second);
+        }
+
+        bool has_fp_arith() const {
+            for (const auto &it : data) {
+                if (fp_arith_width(it.first) != 0) return true;
+            }
+            return false;
+        }
+
+        /// Operand width in bits of fp_arith_* events in any mode, 0 for all other events
+        static unsigned int fp_arith_width(const Event &event) {
+            if (!counts_occurrences(event)) return 0;
+            switch (base_event(event)) {
+                case fp_arith_scalar_single:
+                    return 32;
+                case fp_arith_scalar_double:
+                    return 64;
+                case fp_arith_128b_packed_double:
+                case fp_arith_128b_packed_single:
+                    return 128;
+                case fp_arith_256b_packed_double:
+                case fp_arith_256b_packed_single:
+                    return 256;
+                case fp_arith_512b_packed_double:
+                case fp_arith_512b_packed_single:
+                    return 512;
                 default:
-                    return "Unimplemented";
+                    return 0;
             }
         }
     };
 
+#ifndef PERF_MACOS_DISABLE
     /**
      * Perf::Counter retrieves perf hardware counter
      * values at given points in time.
@@ -250,6 +682,21 @@ namespace Perf {
         };
 
     public:
+        /**
+         * Amount of configurable perf registers, i.e., counters_size() of any
+         * Counter, without setting up (and tearing down) a Counter
+         */
+        static size_t available_counters() {
+            static const size_t count = [] {
+                void *kperf = dlopen(KPERF_FRAMEWORK_PATH, RTLD_LAZY);
+                if (!kperf) throw std::runtime_error(std::string("Unable to load kperf: ").append(dlerror()));
+                auto *get_counter_count = (kpc_get_counter_count_type *) dlsym(kperf, "kpc_get_counter_count");
+                if (!get_counter_count) throw std::runtime_error("kperf missing symbol: kpc_get_counter_count");
+                return static_cast<size_t>(get_counter_count(KPC_CLASSES_MASK));
+            }();
+            return count;
+        }
+
         /**
          * Initialize a counter, optionally specifying which events to measure.
          * On systems with fewer perf counter registers than requested counter
@@ -265,13 +712,15 @@ namespace Perf {
             _counters_size = kpc_get_counter_count(KPC_CLASSES_MASK);
             start_counters = new uint64_t[_counters_size];
             stop_counters = new uint64_t[_counters_size];
+            total_counters = new uint64_t[_counters_size];
         }
 
         ~Counter() {
             teardown_counters();
 
-            delete start_counters;
-            delete stop_counters;
+            delete[] start_counters;
+            delete[] stop_counters;
+            delete[] total_counters;
         }
 
         /**
@@ -290,10 +739,65 @@ namespace Perf {
         forceinline void start() {
             // Setup counters according to our configuration
             configure_counters();
+            std::fill(total_counters, total_counters + _counters_size, 0);
+            total_time_ns = 0;
+            pauses = 0;
+            paused = false;
+            lap_names.clear();
+            lap_counters.clear();
+            lap_times_ns.clear();
+
+            start_time = std::chrono::steady_clock::now();
+            read_counters(start_counters);
+        }
+
+        /**
+         * Pauses measuring, e.g., to exclude per-iteration setup work.
+         * Counter and time deltas since start() or the last resume()
+         * are accumulated into the running totals. Costs one counter
+         * read, i.e., is considerably cheaper than stop() and start().
+         */
+        forceinline void pause() {
+            if (paused) return;
+            accumulate();
+            paused = true;
+            pauses++;
+        }
+
+        /**
+         * Resumes measuring after pause(). Costs one counter read
+         */
+        forceinline void resume() {
+            if (!paused) return;
+            paused = false;
             start_time = std::chrono::steady_clock::now();
             read_counters(start_counters);
         }
 
+        /**
+         * Ends the current lap without stopping, e.g., to obtain a per-phase
+         * breakdown of a multi-phase algorithm. Costs one counter read and
+         * does not reconfigure any registers. Work between the last lap and
+         * stop() is only contained in the total. The name is copied after the
+         * counter read, i.e., it may be built at runtime.
+         *
+         * @param name name of the lap
+         */
+        forceinline void lap(const std::string_view name) {
+            if (paused) {
+                lap_counters.insert(lap_counters.end(), total_counters, total_counters + _counters_size);
+                lap_times_ns.push_back(total_time_ns);
+            } else {
+                read_counters(stop_counters);
+                const auto lap_time = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < _counters_size; i++) {
+                    lap_counters.push_back(total_counters[i] + stop_counters[i] - start_counters[i]);
+                }
+                lap_times_ns.push_back(total_time_ns + (lap_time - start_time).count());
+            }
+            lap_names.emplace_back(name);
+        }
+
         /**
          * Stops measuring and afterwards, computes elapsed counter
          * deltas since last start() invocation. Designed to induce
@@ -308,18 +812,73 @@ namespace Perf {
          * multiple times over your benchmark and then average
          * the resulting measurement.
          *
-         * @return elapsed counter deltas since last start() invocation
+         * @return elapsed counter deltas since last start() invocation, excluding
+         *  paused intervals. Measurement::pauses contains the amount of pauses
+         *  and Measurement::laps the deltas of each lap()
          */
         forceinline Measurement<uint64_t> stop() {
-            read_counters(stop_counters);
-            const auto end_time = std::chrono::steady_clock::now();
+            if (!paused) accumulate();
+            paused = true;
 
+            const auto events_size = std::min(_counters_size, measured_events.size());
+            std::vector<Measurement<uint64_t>::Lap> laps;
+            for (size_t lap = 0; lap < lap_names.size(); lap++) {
+                const auto *current = &lap_counters[lap * _counters_size];
+                const auto *previous = lap == 0 ? nullptr : &lap_counters[(lap - 1) * _counters_size];
+                std::unordered_map<Event, uint64_t> lap_values{};
+                for (size_t i = 0; i < events_size; i++) {
+                    lap_values.emplace(measured_events[i], current[i] - (previous == nullptr ? 0 : previous[i]));
+                }
+                const auto lap_time = lap_times_ns[lap] - (lap == 0 ? 0 : lap_times_ns[lap - 1]);
+                laps.push_back({lap_names[lap], lap_values, lap_time});
+            }
+
+            std::unordered_map<Event, uint64_t> counter_values{};
+            for (size_t i = 0; i < events_size; i++) counter_values.emplace(measured_events[i], total_counters[i]);
+            return Measurement(counter_values, total_time_ns, pauses, laps);
+        }
+
+        /**
+         * Amount of perf counter registers sampled by read(), i.e., the
+         * minimum size of buffers passed to read()
+         */
+        size_t counters_size() const { return _counters_size; }
+
+        /**
+         * Events measured by this counter, in perf register order
+         */
+        const std::vector<Event> &events() const { return measured_events; }
+
+        /**
+         * Configures perf registers according to this counter's events
+         * without taking a sample. start() implicitly does this, i.e.,
+         * configure() is only required when sampling via read().
+         */
+        forceinline void configure() { configure_counters(); }
+
+        /**
+         * Reads raw perf register values of the current thread. This is
+         * the lowest overhead way of sampling a configure()d counter,
+         * e.g., from within instrumentation handlers.
+         *
+         * @param counters buffer of at least counters_size() elements
+         */
+        forceinline void read(uint64_t *counters) const { read_counters(counters); }
+
+        /**
+         * Computes the measurement between two raw samples obtained via read()
+         *
+         * @param from earlier sample
+         * @param to later sample
+         * @param time_delta_ns elapsed time between both samples
+         */
+        Measurement<uint64_t> delta(const uint64_t *from, const uint64_t *to, const long double time_delta_ns) const {
             std::unordered_map<Event, uint64_t> counter_values{};
             for (size_t i = 0; i < std::min(_counters_size, measured_events.size()); i++) {
                 // TODO: deal with overflow in counter registers (automagically handled by xnu/kperf?)
-                counter_values.emplace(measured_events[i], stop_counters[i] - start_counters[i]);
+                counter_values.emplace(measured_events[i], to[i] - from[i]);
             }
-            return Measurement(counter_values, (end_time - start_time).count());
+            return Measurement(counter_values, time_delta_ns);
         }
 
     private:
@@ -330,6 +889,29 @@ namespace Perf {
         uint64_t *stop_counters;
         std::chrono::time_point<std::chrono::steady_clock> start_time;
 
+        // Running totals of all active (i.e., not paused) intervals
+        uint64_t *total_counters;
+        long double total_time_ns = 0;
+        uint64_t pauses = 0;
+        bool paused = true;
+
+        // Cumulative (i.e., since start()) counter values and time at each lap
+        std::vector<std::string> lap_names;
+        std::vector<uint64_t> lap_counters;
+        std::vector<long double> lap_times_ns;
+
+        /// Closes the current active interval and adds its deltas to the running totals
+        forceinline void accumulate() {
+            read_counters(stop_counters);
+            const auto end_time = std::chrono::steady_clock::now();
+
+            for (size_t i = 0; i < _counters_size; i++) {
+                // TODO: deal with overflow in counter registers (automagically handled by xnu/kperf?)
+                total_counters[i] += stop_counters[i] - start_counters[i];
+            }
+            total_time_ns += (end_time - start_time).count();
+        }
+
         forceinline void read_counters(uint64_t *counters) const {
             // Obtain counters for current thread
             if (kpc_get_thread_counters(0, _counters_size, counters)) {
@@ -339,28 +921,18 @@ namespace Perf {
 
         forceinline void configure_counters() {
             auto configs_cnt = kpc_get_config_count(KPC_CLASSES_MASK);
+            // Registers without a selected event are programmed with a zero (i.e., disabled) config
             uint64_t configs[configs_cnt];
+            std::fill(configs, configs + configs_cnt, 0);
 
 #ifdef CPU_X86_64
-            /**
-             * - Intel 64 and IA-32 Architectures Software Developer's Manual, Volume 3, Section 18.2.1.1.
-             * - https://github.com/apple/darwin-xnu/blob/8f02f2a044b9bb1ad951987ef5bab20ec9486310/osfmk/x86_64/kpc_x86.c#L348
-             */
-            const uint64_t INTEL_CONF_CTR_USER_MODE = 0x10000;
-            //        const uint64_t INTEL_CONF_CTR_OS_MODE = 0x20000;
-            //        const uint64_t INTEL_CONF_CTR_EDGE_DETECT = 0x40000;
-            //        const uint64_t INTEL_CONF_CTR_ENABLED = 0x200000;
-            //        const uint64_t INTEL_CONF_CTR_INVERTED = 0x400000;
-            //        const auto INTEL_CONF_CTR_CMASK = [](const uint8_t cmask) { return (cmask & 0xFF) << 24; };
-
-            for (size_t i = 0; i < configs_cnt; i++) {
-                if (i >= measured_events.size()) {
-                    std::cout << "[Perf::Counter] More configurable perf registers are available than were selected"
-                              << std::endl;
-                    break;
-                }
+            // See Perf::INTEL_CONF_CTR_USER_MODE
+            //        const uint64_t INTEL_CONF_CTR_ENABLED = 0x400000;
 
-                configs[i] = (0xFFFF & measured_events[i]) | INTEL_CONF_CTR_USER_MODE;
+            for (size_t i = 0; i < std::min<size_t>(configs_cnt, measured_events.size()); i++) {
+                // Events without mode only count in user mode
+                const uint64_t mode = measured_events[i] & (INTEL_CONF_CTR_USER_MODE | INTEL_CONF_CTR_OS_MODE);
+                configs[i] = measured_events[i] | (mode == 0 ? INTEL_CONF_CTR_USER_MODE : 0);
             }
 #elif defined(CPU_ARM64)
 #error "arm64 not fully implemented"
@@ -419,7 +991,5141 @@ namespace Perf {
     private:
         const size_t N;
     };
-}// namespace Perf
+#else
+    /**
+     * Perf::Counter with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     *
+     * All members are empty inline no-ops, i.e., bracketed code compiles to
+     * exactly the same machine code as without any instrumentation. stop()
+     * returns an empty measurement. See `make test-codegen`.
+     */
+    struct Counter {
+        Counter(std::initializer_list<Event> = {}) {}
+        Counter(const std::vector<Event> &) {}
+
+        void start() {}
+        void pause() {}
+        void resume() {}
+        void lap(const std::string_view) {}
+        Measurement<uint64_t> stop() { return {}; }
+
+        size_t counters_size() const { return 0; }
+        static size_t available_counters() { return 0; }
+        const std::vector<Event> &events() const {
+            static const std::vector<Event> none;
+            return none;
+        }
+        void configure() {}
+        void read(uint64_t *) const {}
+        Measurement<uint64_t> delta(const uint64_t *, const uint64_t *, const long double) const { return {}; }
+    };
+
+    /**
+     * Perf::BlockCounter with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Neither measures nor prints anything.
+     */
+    struct BlockCounter : public Counter {
+        BlockCounter(const size_t, std::initializer_list<Event> = {}) {}
+        BlockCounter(const size_t, const std::vector<Event> &) {}
+    };
+
+#ifdef PERF_MACOS_XRAY
+    /**
+     * Perf::XRayProfiler with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Never patches any function.
+     */
+    struct XRayProfiler {
+        struct FunctionProfile {
+            std::string name;
+            uint64_t calls;
+            Measurement<uint64_t> total;
+        };
+
+        XRayProfiler(std::initializer_list<Event> = {}) {}
+        XRayProfiler(const std::vector<Event> &) {}
+
+        size_t patch(const std::string &) { return 0; }
+        size_t unpatch(const std::string &) { return 0; }
+        void unpatch_all() {}
+        std::vector<FunctionProfile> results() const { return {}; }
+    };
+#endif
+#endif
+
+#if defined(PERF_MACOS_XRAY) && !defined(PERF_MACOS_DISABLE)
+    /**
+     * Runtime patchable per-function counter profiling based on clang's XRay
+     * instrumentation. Compile with `-fxray-instrument` (and optionally
+     * `-fxray-instruction-threshold=1` to also instrument tiny functions).
+     *
+     * Unpatched functions only carry XRay's NOP sleds, i.e., instrumentation
+     * is virtually free until patch() is invoked. Patched functions sample
+     * all measured perf counters on entry and exit and accumulate the deltas
+     * into per-thread buffers, without any synchronization on the hot path.
+     * Note that accumulated values are inclusive, i.e., contain callees.
+     *
+     * XRay only supports a single global handler, therefore at most one
+     * XRayProfiler may exist at any point in time.
+     */
+    struct XRayProfiler {
+        /// Accumulated measurements of a single instrumented function
+        struct FunctionProfile {
+            std::string name;
+            uint64_t calls;
+            Measurement<uint64_t> total;
+        };
+
+        /**
+         * Installs the XRay handler. Functions remain unpatched until patch() is called
+         *
+         * @param measured_events events sampled on each function entry and exit
+         */
+        XRayProfiler(std::vector<Event> measured_events = {instructions_retired, l1_misses, llc_misses,
+                                                           branch_misses_retired, cycles, branch_instruction_retired})
+            : counter(measured_events) {
+            XRayProfiler *expected = nullptr;
+            if (!active.compare_exchange_strong(expected, this)) {
+                throw std::runtime_error("Only one Perf::XRayProfiler may exist at a time");
+            }
+
+            counter.configure();
+            generation.fetch_add(1, std::memory_order_relaxed);
+            if (!__xray_set_handler(&handler)) {
+                active.store(nullptr);
+                throw std::runtime_error("Failed to install xray handler. Did you compile with -fxray-instrument?");
+            }
+        }
+
+        ~XRayProfiler() {
+            __xray_unpatch();
+            __xray_remove_handler();
+            active.store(nullptr);
+        }
+
+        /**
+         * Patches all instrumented functions whose (demangled) name matches pattern
+         *
+         * @param pattern ECMAScript regular expression, e.g., "^hash_join::probe"
+         * @return amount of patched functions
+         */
+        size_t patch(const std::string &pattern) { return apply(pattern, true); }
+
+        /**
+         * Unpatches all instrumented functions whose (demangled) name matches pattern,
+         * reducing their overhead back to XRay's NOP sleds
+         *
+         * @param pattern ECMAScript regular expression
+         * @return amount of unpatched functions
+         */
+        size_t unpatch(const std::string &pattern) { return apply(pattern, false); }
+
+        /**
+         * Unpatches all instrumented functions
+         */
+        void unpatch_all() { __xray_unpatch(); }
+
+        /**
+         * Merges all per-thread buffers into one profile per function. Per-thread
+         * buffers are not synchronized, i.e., only call this once instrumented
+         * threads are quiescent (e.g., after unpatching).
+         */
+        std::vector<FunctionProfile> results() const {
+            std::unordered_map<int32_t, Totals> merged;
+            {
+                std::lock_guard<std::mutex> lock(buffers_mutex);
+                for (const auto &buffer : buffers) {
+                    for (const auto &[function_id, totals] : buffer->totals) {
+                        auto &target = merged[function_id];
+                        target.calls += totals.calls;
+                        target.time_ns += totals.time_ns;
+                        target.counters.resize(totals.counters.size(), 0);
+                        for (size_t i = 0; i < totals.counters.size(); i++) target.counters[i] += totals.counters[i];
+                    }
+                }
+            }
+
+            std::vector<FunctionProfile> profiles;
+            for (const auto &[function_id, totals] : merged) {
+                std::unordered_map<Event, uint64_t> values;
+                for (size_t i = 0; i < std::min(totals.counters.size(), counter.events().size()); i++) {
+                    values.emplace(counter.events()[i], totals.counters[i]);
+                }
+                profiles.push_back({function_name(function_id), totals.calls, Measurement(values, totals.time_ns)});
+            }
+            return profiles;
+        }
+
+    private:
+        /// Maximum tracked call depth per thread. Deeper frames are not measured
+        static constexpr size_t max_depth = 256;
+
+        struct Totals {
+            uint64_t calls = 0;
+            long double time_ns = 0;
+            std::vector<uint64_t> counters;
+        };
+
+        struct alignas(64) ThreadBuffer {
+            bool in_handler = false;
+            size_t depth = 0;
+            std::vector<int32_t> function_ids;
+            std::vector<std::chrono::time_point<std::chrono::steady_clock>> times;
+            std::vector<uint64_t> samples;
+            std::vector<uint64_t> exit_sample;
+            std::unordered_map<int32_t, Totals> totals;
+
+            explicit ThreadBuffer(size_t counters_size)
+                : function_ids(max_depth), times(max_depth), samples(max_depth * counters_size),
+                  exit_sample(counters_size) {}
+        };
+
+        Counter counter;
+        mutable std::mutex buffers_mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+        static inline std::atomic<XRayProfiler *> active = nullptr;
+        static inline std::atomic<uint64_t> generation = 0;
+
+        [[clang::xray_never_instrument]] ThreadBuffer *thread_buffer() {
+            static thread_local ThreadBuffer *buffer = nullptr;
+            static thread_local uint64_t buffer_generation = 0;
+
+            const auto current_generation = generation.load(std::memory_order_relaxed);
+            if (buffer_generation != current_generation) {
+                // First event on this thread for this profiler. Buffers are owned by
+                // the profiler such that results outlive their threads
+                std::lock_guard<std::mutex> lock(buffers_mutex);
+                buffers.push_back(std::make_unique<ThreadBuffer>(counter.counters_size()));
+                buffer = buffers.back().get();
+                buffer_generation = current_generation;
+            }
+            return buffer;
+        }
+
+        [[clang::xray_never_instrument]] static void handler(int32_t function_id, XRayEntryType type) {
+            auto *self = active.load(std::memory_order_acquire);
+            if (self == nullptr) return;
+
+            auto *buffer = self->thread_buffer();
+            // Guard against recursion, e.g., when patching functions used by the handler itself
+            if (buffer->in_handler) return;
+            buffer->in_handler = true;
+
+            const auto counters_size = self->counter.counters_size();
+            switch (type) {
+                case XRayEntryType::ENTRY:
+                case XRayEntryType::LOG_ARGS_ENTRY: {
+                    const auto depth = buffer->depth++;
+                    if (depth < max_depth) {
+                        buffer->function_ids[depth] = function_id;
+                        buffer->times[depth] = std::chrono::steady_clock::now();
+                        self->counter.read(&buffer->samples[depth * counters_size]);
+                    }
+                    break;
+                }
+                case XRayEntryType::EXIT:
+                case XRayEntryType::TAIL: {
+                    // Exit of an untracked frame beyond max_depth, leaves the tracked frames alone
+                    if (buffer->depth > max_depth) {
+                        buffer->depth--;
+                        break;
+                    }
+
+                    self->counter.read(buffer->exit_sample.data());
+                    const auto end_time = std::chrono::steady_clock::now();
+
+                    // Frames skipped by exceptions or longjmp never see their exit event.
+                    // Unwind to the matching entry, discarding everything in between. Exits
+                    // without a tracked entry, e.g., of frames entered before patching, leave
+                    // the stack alone
+                    auto depth = buffer->depth;
+                    while (depth > 0 && buffer->function_ids[depth - 1] != function_id) depth--;
+                    if (depth == 0) break;
+                    buffer->depth = --depth;
+
+                    auto &totals = buffer->totals[function_id];
+                    totals.counters.resize(counters_size, 0);
+                    totals.calls++;
+                    totals.time_ns += (end_time - buffer->times[depth]).count();
+                    const auto *start_sample = &buffer->samples[depth * counters_size];
+                    for (size_t i = 0; i < counters_size; i++) {
+                        totals.counters[i] += buffer->exit_sample[i] - start_sample[i];
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            buffer->in_handler = false;
+        }
+
+        size_t apply(const std::string &pattern, const bool patch) {
+            const std::regex regex(pattern);
+
+            size_t matched = 0;
+            const auto max_function_id = static_cast<int32_t>(__xray_max_function_id());
+            for (int32_t function_id = 1; function_id <= max_function_id; function_id++) {
+                if (!std::regex_search(function_name(function_id), regex)) continue;
+
+                const auto status = patch ? __xray_patch_function(function_id) : __xray_unpatch_function(function_id);
+                if (status != XRayPatchingStatus::SUCCESS) {
+                    throw std::runtime_error("Failed to (un)patch xray function #" + std::to_string(function_id));
+                }
+                matched++;
+            }
+            return matched;
+        }
+
+        static std::string function_name(const int32_t function_id) {
+            const auto address = __xray_function_address(function_id);
+
+            Dl_info info;
+            if (address == 0 || !dladdr(reinterpret_cast<void *>(address), &info) || info.dli_sname == nullptr ||
+                reinterpret_cast<uintptr_t>(info.dli_saddr) != address) {
+                return "xray function #" + std::to_string(function_id);
+            }
+
+            int status = 0;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::string name = status == 0 && demangled != nullptr ? demangled : info.dli_sname;
+            free(demangled);
+            return name;
+        }
+    };
+#endif
+
+    /**
+     * Measures fn once per given group of events and merges the results,
+     * e.g., to place events that only count on specific perf registers. Each
+     * group is programmed in order, i.e., its i-th event into the i-th
+     * register, and must fit into the available perf registers.
+     *
+     * @param groups events to measure, one run per group
+     * @param fn code to measure, invoked once per group
+     * @return merged counter values. Elapsed time is averaged across all invocations
+     */
+    template<class F>
+    Measurement<uint64_t> measure_groups(const std::vector<std::vector<Event>> &groups, F &&fn) {
+        if (Counter::available_counters() == 0) {
+            fn();
+            return {};
+        }
+
+        std::unordered_map<Event, uint64_t> values;
+        long double time_ns = 0;
+        size_t runs = 0;
+        for (const auto &group : groups) {
+            if (group.size() > Counter::available_counters()) {
+                throw std::invalid_argument("Event group exceeds the available perf registers");
+            }
+            Counter counter(group);
+            counter.start();
+            fn();
+            const auto measurement = counter.stop();
+
+            values.insert(measurement.data.begin(), measurement.data.end());
+            time_ns += measurement.time_delta_ns;
+            runs++;
+        }
+        return Measurement(values, runs == 0 ? 0 : time_ns / runs);
+    }
+
+    /**
+     * Measures fn once per group of events that fit into the available perf
+     * registers and merges the results, i.e., allows measuring more events
+     * than the CPU has perf registers. fn should be deterministic, since
+     * each group observes a different execution.
+     *
+     * @param events events to measure. Order decides grouping
+     * @param fn code to measure, invoked once per group
+     * @return merged counter values. Elapsed time is averaged across all invocations
+     */
+    template<class F>
+    Measurement<uint64_t> measure_grouped(const std::vector<Event> &events, F &&fn) {
+        const size_t group_size = Counter::available_counters();
+        std::vector<std::vector<Event>> groups;
+        for (size_t begin = 0; group_size > 0 && begin < events.size(); begin += group_size) {
+            groups.emplace_back(events.begin() + begin, events.begin() + std::min(begin + group_size, events.size()));
+        }
+        return measure_groups(groups, std::forward<F>(fn));
+    }
+
+    /**
+     * Roofline model of the current machine. Places measured code regions by
+     * arithmetic intensity (FLOP per DRAM byte) versus attained FLOP/s, which
+     * tells whether a region is compute or memory bound.
+     *
+     * FLOPs are obtained from the FP_ARITH_INST_RETIRED events, weighted by
+     * vector width (FMAs count twice). DRAM traffic is estimated as 64 bytes per
+     * LLC miss plus 64 bytes per dirty L2 eviction. Client CPUs do not expose
+     * DRAM writes to core perf registers, i.e., the latter is an upper bound for
+     * LLC writebacks.
+     */
+    struct Roofline {
+        /// A measured code region placed on the roofline
+        struct Point {
+            std::string name;
+            uint64_t flops;
+            uint64_t bytes;
+            long double time_ns;
+
+            long double arithmetic_intensity() const { return static_cast<long double>(flops) / bytes; }
+            long double flops_per_second() const { return flops / (time_ns * 1e-9L); }
+        };
+
+        /// Events required for placing a region on the roofline
+        static inline const std::vector<Event> events = [] {
+            auto events = fp_arith_events;
+            events.push_back(llc_misses);
+            events.push_back(l2_lines_out_non_silent);
+            return events;
+        }();
+
+        const long double peak_flops_per_second;
+        const long double peak_bytes_per_second;
+
+        /**
+         * Construct a roofline from known machine peaks, e.g., from the CPU's data sheet
+         */
+        Roofline(const long double peak_flops_per_second, const long double peak_bytes_per_second)
+            : peak_flops_per_second(peak_flops_per_second), peak_bytes_per_second(peak_bytes_per_second) {}
+
+        /**
+         * Construct a roofline from peaks measured by built-in probes. Note that
+         * the compute probe can only use vector instructions enabled for the
+         * current translation unit, i.e., compile with -march=native to probe
+         * AVX/FMA peaks. Both probes are single threaded.
+         *
+         * @param bandwidth_probe_bytes size of the streamed buffer, should be well beyond LLC size
+         */
+        static Roofline probe(const size_t bandwidth_probe_bytes = 512ull << 20) {
+            return Roofline(probe_peak_flops(), probe_peak_bandwidth(bandwidth_probe_bytes));
+        }
+
+        /**
+         * Measures fn and places it on the roofline. fn is invoked once per
+         * group of events that fits into the available perf registers.
+         *
+         * @param name name of the region, used for reporting
+         * @param fn deterministic code region to measure
+         */
+        template<class F>
+        const Point &measure(const std::string &name, F &&fn) {
+            const auto measurement = measure_grouped(events, std::forward<F>(fn));
+            points.push_back({name, flops(measurement), dram_bytes(measurement), measurement.time_delta_ns});
+            return points.back();
+        }
+
+        /// Weighted floating point operations contained in a measurement
+        template<class D>
+        static D flops(const Measurement<D> &measurement) {
+            const std::pair<Event, D> weights[] = {
+                    {fp_arith_scalar_double, 1},      {fp_arith_scalar_single, 1},
+                    {fp_arith_128b_packed_double, 2}, {fp_arith_128b_packed_single, 4},
+                    {fp_arith_256b_packed_double, 4}, {fp_arith_256b_packed_single, 8},
+                    {fp_arith_512b_packed_double, 8}, {fp_arith_512b_packed_single, 16}};
+
+            // Sums the user and kernel mode variants of each event, see Perf::split_modes
+            D result = 0;
+            for (const auto &[event, value] : measurement.data) {
+                if (!counts_occurrences(event)) continue;
+                for (const auto &[weighted, weight] : weights) {
+                    if (base_event(event) == weighted) result += value * weight;
+                }
+            }
+            return result;
+        }
+
+        /// Estimated DRAM traffic in bytes contained in a measurement
+        template<class D>
+        static D dram_bytes(const Measurement<D> &measurement) {
+            D lines = 0;
+            for (const auto &[event, value] : measurement.data) {
+                if (!counts_occurrences(event)) continue;
+                if (base_event(event) == llc_misses || base_event(event) == l2_lines_out_non_silent) lines += value;
+            }
+            return lines * 64;
+        }
+
+        /// Arithmetic intensity at which the memory and compute roofs intersect
+        long double ridge_point() const { return peak_flops_per_second / peak_bytes_per_second; }
+
+        /// Maximum attainable FLOP/s at a given arithmetic intensity
+        long double attainable(const long double arithmetic_intensity) const {
+            return std::min(peak_flops_per_second, arithmetic_intensity * peak_bytes_per_second);
+        }
+
+        bool memory_bound(const Point &point) const { return point.arithmetic_intensity() < ridge_point(); }
+
+        /// All regions measured so far
+        const std::vector<Point> &measured() const { return points; }
+
+        /**
+         * Pretty print the roofline peaks followed by one row per measured region
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            std::cout << "Peak [GFLOP/s]: " << std::to_string(peak_flops_per_second * 1e-9L)
+                      << ", peak bandwidth [GB/s]: " << std::to_string(peak_bytes_per_second * 1e-9L)
+                      << ", ridge point [FLOP/B]: " << std::to_string(ridge_point()) << std::endl;
+
+            std::cout << std::setw(column_width) << "Region" << std::setw(column_width) << "AI [FLOP/B]"
+                      << std::setw(column_width) << "GFLOP/s" << std::setw(column_width) << "Roof [GFLOP/s]"
+                      << std::setw(column_width) << "Of roof [%]" << std::setw(column_width) << "Bound" << std::endl;
+            for (const auto &point : points) {
+                const auto roof = attainable(point.arithmetic_intensity());
+                std::cout << std::setw(column_width) << point.name << std::setw(column_width)
+                          << std::to_string(point.arithmetic_intensity()) << std::setw(column_width)
+                          << std::to_string(point.flops_per_second() * 1e-9L) << std::setw(column_width)
+                          << std::to_string(roof * 1e-9L) << std::setw(column_width)
+                          << std::to_string(100.0L * point.flops_per_second() / roof) << std::setw(column_width)
+                          << (memory_bound(point) ? "memory" : "compute") << std::endl;
+            }
+        }
+
+    private:
+        std::vector<Point> points;
+
+        static long double probe_peak_flops() {
+            // Enough independent accumulators to hide add/mul/fma latency on current cores
+            typedef double vec __attribute__((vector_size(32)));
+            constexpr size_t accumulators = 12;
+            constexpr size_t iterations = 1u << 22;
+
+            volatile double seed = 1.0;
+            const vec mul = vec{} + seed * 0.999999;
+            const vec add = vec{} + seed * 1e-9;
+            vec acc[accumulators];
+            for (size_t j = 0; j < accumulators; j++) acc[j] = vec{} + seed * static_cast<double>(j);
+
+            const auto start_time = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++) {
+                for (size_t j = 0; j < accumulators; j++) acc[j] = acc[j] * mul + add;
+            }
+            const auto end_time = std::chrono::steady_clock::now();
+
+            double sum = 0;
+            for (size_t j = 0; j < accumulators; j++) {
+                for (size_t k = 0; k < sizeof(vec) / sizeof(double); k++) sum += acc[j][k];
+            }
+            asm volatile("" : : "r,m"(sum) : "memory");
+
+            const long double flops = 2.0L * iterations * accumulators * (sizeof(vec) / sizeof(double));
+            return flops / (std::chrono::duration<long double>(end_time - start_time).count());
+        }
+
+        static long double probe_peak_bandwidth(const size_t bytes) {
+            std::vector<uint64_t> buffer(bytes / sizeof(uint64_t), 1);
+            constexpr size_t repetitions = 4;
+
+            uint64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+            const auto start_time = std::chrono::steady_clock::now();
+            for (size_t r = 0; r < repetitions; r++) {
+                for (size_t i = 0; i + 3 < buffer.size(); i += 4) {
+                    sum0 += buffer[i];
+                    sum1 += buffer[i + 1];
+                    sum2 += buffer[i + 2];
+                    sum3 += buffer[i + 3];
+                }
+                asm volatile("" : : : "memory");
+            }
+            const auto end_time = std::chrono::steady_clock::now();
+
+            const auto sum = sum0 + sum1 + sum2 + sum3;
+            asm volatile("" : : "r,m"(sum) : "memory");
+
+            return static_cast<long double>(repetitions * buffer.size() * sizeof(uint64_t)) /
+                   std::chrono::duration<long double>(end_time - start_time).count();
+        }
+    };
+
+    /**
+     * Memory stall breakdown of code regions, e.g., to tell whether the misses
+     * of pointer heavy lookups overlap. Combines outstanding L1D miss occupancy
+     * (memory-level parallelism) with the CYCLE_ACTIVITY stall events of the
+     * detected CPU (Intel 64 and IA-32 Architectures Optimization Reference
+     * Manual, Appendix B.1, top-down analysis).
+     *
+     * Stalls are attributed to the innermost cache level that missed, e.g.,
+     * stalls with an outstanding L2 but no L3 miss are L3 stalls. Haswell and
+     * Broadwell do not distinguish L3 from DRAM stalls, i.e., l3_stalls
+     * contains DRAM stalls and dram_stalls is NaN.
+     */
+    struct MemoryStalls {
+        /// Breakdown of a measured region. Stall and outstanding fractions are relative to all cycles
+        struct Breakdown {
+            std::string name;
+            Measurement<uint64_t> measurement;
+            long double memory_level_parallelism;
+            long double stalls;
+            long double l1_stalls;
+            long double l2_stalls;
+            long double l3_stalls;
+            long double dram_stalls;
+            long double no_memory_outstanding;
+        };
+
+        /// Whether the detected CPU uses Haswell/Broadwell (as opposed to Skylake and later) stall events
+        const bool haswell;
+
+        /**
+         * Event groups measured for the breakdown on the detected CPU. Some
+         * events only count on the third perf register, i.e., each group
+         * contains at most one of them, placed in that register
+         */
+        const std::vector<std::vector<Event>> groups;
+
+        MemoryStalls()
+            : haswell(detect_haswell()),
+              groups(haswell ? group(haswell_restricted_events(), haswell_events(), Counter::available_counters())
+                             : group(skylake_restricted_events(), skylake_events(), Counter::available_counters())) {}
+
+        /**
+         * Measures fn and computes its memory stall breakdown. fn is invoked
+         * once per group of events that fits into the available perf registers.
+         *
+         * @param name name of the region, used for reporting
+         * @param fn deterministic code region to measure
+         */
+        template<class F>
+        const Breakdown &measure(const std::string &name, F &&fn) {
+            const auto measurement = measure_groups(groups, std::forward<F>(fn));
+            const auto value = [&](const Event &event) {
+                const auto it = measurement.data.find(event);
+                return it == measurement.data.end() ? std::numeric_limits<long double>::quiet_NaN()
+                                                    : static_cast<long double>(it->second);
+            };
+
+            const auto cycles_total = value(cycles);
+            const auto stalls_l1d = value(cycle_activity(cycle_activity_stalls_l1d_miss));
+            const auto stalls_l2 = value(cycle_activity(cycle_activity_stalls_l2_miss));
+            const auto stalls_mem =
+                    value(haswell ? haswell_stalls_mem_any : cycle_activity(cycle_activity_stalls_mem_any));
+            const auto stalls_l3 = haswell ? 0 : value(cycle_activity(cycle_activity_stalls_l3_miss));
+            const auto cycles_mem =
+                    value(haswell ? haswell_cycles_mem_any : cycle_activity(cycle_activity_cycles_mem_any));
+
+            results.push_back({name, measurement, value(l1d_pend_miss_pending) / value(l1d_pend_miss_cycles),
+                               value(cycle_activity(cycle_activity_stalls_total)) / cycles_total,
+                               (stalls_mem - stalls_l1d) / cycles_total, (stalls_l1d - stalls_l2) / cycles_total,
+                               (stalls_l2 - stalls_l3) / cycles_total,
+                               haswell ? std::numeric_limits<long double>::quiet_NaN() : stalls_l3 / cycles_total,
+                               1 - cycles_mem / cycles_total});
+            return results.back();
+        }
+
+        /// All regions measured so far
+        const std::vector<Breakdown> &measured() const { return results; }
+
+        /**
+         * Pretty print one row per measured region, next to its L1 and LLC misses
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            std::cout << std::setw(column_width) << "Region";
+            for (const auto &header : {"L1 misses", "LLC misses", "MLP", "Stalls [%]", "L1 [%]", "L2 [%]", "L3 [%]",
+                                       "DRAM [%]", "No mem [%]"}) {
+                std::cout << std::setw(column_width) << header;
+            }
+            std::cout << std::endl;
+
+            for (const auto &result : results) {
+                const auto misses = [&](const Event &event) {
+                    const auto it = result.measurement.data.find(event);
+                    return it == result.measurement.data.end() ? std::string("-") : std::to_string(it->second);
+                };
+                std::cout << std::setw(column_width) << result.name << std::setw(column_width) << misses(l1_misses)
+                          << std::setw(column_width) << misses(llc_misses) << std::setw(column_width)
+                          << std::to_string(result.memory_level_parallelism);
+                for (const auto fraction : {result.stalls, result.l1_stalls, result.l2_stalls, result.l3_stalls,
+                                            result.dram_stalls, result.no_memory_outstanding}) {
+                    std::cout << std::setw(column_width) << std::to_string(100 * fraction);
+                }
+                std::cout << std::endl;
+            }
+        }
+
+    private:
+        std::vector<Breakdown> results;
+
+        // Haswell/Broadwell only: CYCLE_ACTIVITY.STALLS_LDM_PENDING and CYCLE_ACTIVITY.CYCLES_LDM_PENDING
+        static constexpr Event haswell_stalls_mem_any = counter_mask(static_cast<Event>(0x06A3), 6);
+        static constexpr Event haswell_cycles_mem_any = counter_mask(static_cast<Event>(0x02A3), 2);
+
+        /// Index of the only perf register counting restricted events
+        static constexpr size_t restricted_register = 2;
+
+        static std::vector<Event> skylake_restricted_events() { return {l1d_pend_miss_pending}; }
+
+        static std::vector<Event> skylake_events() {
+            return {cycles,
+                    cycle_activity(cycle_activity_stalls_total),
+                    l1d_pend_miss_cycles,
+                    cycle_activity(cycle_activity_stalls_mem_any),
+                    cycle_activity(cycle_activity_stalls_l1d_miss),
+                    cycle_activity(cycle_activity_stalls_l2_miss),
+                    cycle_activity(cycle_activity_stalls_l3_miss),
+                    cycle_activity(cycle_activity_cycles_mem_any),
+                    l1_misses,
+                    llc_misses};
+        }
+
+        static std::vector<Event> haswell_restricted_events() {
+            return {l1d_pend_miss_pending, l1d_pend_miss_cycles, cycle_activity(cycle_activity_stalls_l1d_miss)};
+        }
+
+        static std::vector<Event> haswell_events() {
+            return {cycles,
+                    cycle_activity(cycle_activity_stalls_total),
+                    l1_misses,
+                    haswell_stalls_mem_any,
+                    cycle_activity(cycle_activity_stalls_l2_miss),
+                    llc_misses,
+                    haswell_cycles_mem_any,
+                    l2_misses};
+        }
+
+        /**
+         * Groups events for Perf::measure_groups: one group per restricted
+         * event, which is placed in restricted_register, and the remaining
+         * registers filled with the other events. Restricted events are not
+         * measured with too few registers
+         */
+        static std::vector<std::vector<Event>> group(const std::vector<Event> &restricted,
+                                                     const std::vector<Event> &others, const size_t registers) {
+            std::vector<std::vector<Event>> groups;
+            if (registers == 0) return groups;
+
+            size_t next = 0;
+            if (registers > restricted_register) {
+                for (const auto event : restricted) {
+                    std::vector<Event> group;
+                    while (group.size() < restricted_register) {
+                        // Repeats a measured event if the others run out before the restricted register
+                        group.push_back(next < others.size() ? others[next++] : others[group.size()]);
+                    }
+                    group.push_back(event);
+                    while (group.size() < registers && next < others.size()) group.push_back(others[next++]);
+                    groups.push_back(std::move(group));
+                }
+            }
+            for (; next < others.size(); next += registers) {
+                groups.emplace_back(others.begin() + next, others.begin() + std::min(next + registers, others.size()));
+            }
+            return groups;
+        }
+
+        /// Detects Ivy Bridge, Haswell and Broadwell (family 6) via cpuid
+        static bool detect_haswell() {
+#ifdef CPU_X86_64
+            uint32_t eax = 1, ebx, ecx = 0, edx;
+            asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+            const auto family = (eax >> 8) & 0xF;
+            const auto model = ((eax >> 4) & 0xF) | (((eax >> 16) & 0xF) << 4);
+            if (family != 6) return false;
+            for (const auto haswell_model : {0x3A, 0x3E, 0x3C, 0x3F, 0x45, 0x46, 0x3D, 0x47, 0x4F, 0x56}) {
+                if (model == static_cast<uint32_t>(haswell_model)) return true;
+            }
+#endif
+            return false;
+        }
+    };
+
+    /**
+     * Fixed memory, mergeable streaming quantile sketch (KLL, Karnin, Lang and
+     * Liberty, "Optimal Quantile Approximation in Streams", 2016).
+     *
+     * Retains O(k) values regardless of stream length. Quantile queries have a
+     * normalized rank error of roughly normalized_rank_error() (~1.3% for the
+     * default k = 200). Since the error bound is on ranks, tail quantiles such
+     * as p999 require larger k to be meaningful. Sketches can be merged across
+     * threads and, via serialize()/deserialize(), across processes.
+     *
+     * Not thread safe, i.e., use one sketch per thread and merge.
+     */
+    struct QuantileSketch {
+        /**
+         * @param k accuracy parameter. Memory and update cost grow linearly, rank error shrinks linearly
+         */
+        explicit QuantileSketch(const uint32_t k = 200) : k(k) { grow(); }
+
+        /// Adds a single value to the sketch. Amortized O(log k)
+        forceinline void add(const double value) {
+            levels[0].push_back(value);
+            count++;
+            min = std::min(min, value);
+            max = std::max(max, value);
+            if (++retained >= max_retained) compress();
+        }
+
+        /// Merges other into this sketch. Both sketches should use the same k
+        void merge(const QuantileSketch &other) {
+            while (levels.size() < other.levels.size()) grow();
+            for (size_t h = 0; h < other.levels.size(); h++) {
+                levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+                retained += other.levels[h].size();
+            }
+            count += other.count;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+            while (retained >= max_retained) compress();
+        }
+
+        /**
+         * Estimates the q-quantile of all values added so far
+         *
+         * @param q quantile within [0, 1], e.g., 0.99 for p99
+         * @return estimated value, NaN for empty sketches
+         */
+        double quantile(const double q) const {
+            if (count == 0) return std::numeric_limits<double>::quiet_NaN();
+            if (q <= 0) return min;
+            if (q >= 1) return max;
+
+            std::vector<std::pair<double, uint64_t>> weighted;
+            weighted.reserve(retained);
+            for (size_t h = 0; h < levels.size(); h++) {
+                for (const auto value : levels[h]) weighted.emplace_back(value, 1ull << h);
+            }
+            std::sort(weighted.begin(), weighted.end());
+
+            const auto rank = q * static_cast<double>(count);
+            uint64_t cumulative = 0;
+            for (const auto &[value, weight] : weighted) {
+                cumulative += weight;
+                if (static_cast<double>(cumulative) >= rank) return value;
+            }
+            return max;
+        }
+
+        /// Amount of values added to this sketch (including merged sketches)
+        uint64_t size() const { return count; }
+
+        /// Approximate normalized rank error bound (99% confidence) of quantile queries
+        double normalized_rank_error() const { return 2.296 / std::pow(static_cast<double>(k), 0.9723); }
+
+        /// Serializes this sketch, e.g., for merging across processes
+        std::string serialize() const {
+            std::string bytes;
+            append(bytes, k);
+            append(bytes, static_cast<uint32_t>(levels.size()));
+            append(bytes, count);
+            append(bytes, min);
+            append(bytes, max);
+            for (const auto &level : levels) {
+                append(bytes, static_cast<uint32_t>(level.size()));
+                bytes.append(reinterpret_cast<const char *>(level.data()), level.size() * sizeof(double));
+            }
+            return bytes;
+        }
+
+        /// Deserializes a sketch obtained via serialize()
+        static QuantileSketch deserialize(const std::string &bytes) {
+            size_t offset = 0;
+            QuantileSketch sketch(extract<uint32_t>(bytes, offset));
+            const auto level_count = extract<uint32_t>(bytes, offset);
+            sketch.count = extract<uint64_t>(bytes, offset);
+            sketch.min = extract<double>(bytes, offset);
+            sketch.max = extract<double>(bytes, offset);
+
+            // Each level holds at least its length, and weights 2^h must fit into 64 bits
+            if (level_count > std::min<size_t>(64, (bytes.size() - offset) / sizeof(uint32_t))) {
+                throw std::runtime_error("Malformed Perf::QuantileSketch");
+            }
+            while (sketch.levels.size() < level_count) sketch.grow();
+            for (auto &level : sketch.levels) {
+                const uint64_t size = extract<uint32_t>(bytes, offset);
+                if (offset + size * sizeof(double) > bytes.size()) {
+                    throw std::runtime_error("Malformed Perf::QuantileSketch");
+                }
+                level.resize(size);
+                std::memcpy(level.data(), bytes.data() + offset, level.size() * sizeof(double));
+                offset += level.size() * sizeof(double);
+                sketch.retained += level.size();
+            }
+            return sketch;
+        }
+
+    private:
+        uint32_t k;
+        uint64_t count = 0;
+        size_t retained = 0;
+        size_t max_retained = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+        /// Values at level h carry weight 2^h
+        std::vector<std::vector<double>> levels;
+        std::vector<size_t> capacities;
+
+        void grow() {
+            levels.emplace_back();
+
+            // Capacities decay geometrically (factor 2/3) from the top level downwards
+            capacities.resize(levels.size());
+            max_retained = 0;
+            for (size_t h = 0; h < levels.size(); h++) {
+                const auto depth = static_cast<double>(levels.size() - h - 1);
+                capacities[h] = std::max<size_t>(2, std::ceil(k * std::pow(2.0 / 3.0, depth)));
+                max_retained += capacities[h];
+            }
+        }
+
+        void compress() {
+            for (size_t h = 0; h < levels.size(); h++) {
+                if (levels[h].size() < capacities[h]) continue;
+                if (h + 1 == levels.size()) grow();
+
+                auto &level = levels[h];
+                auto &next = levels[h + 1];
+                std::sort(level.begin(), level.end());
+
+                // Promote every other value (random offset) with doubled weight. For odd
+                // sizes, the smallest value stays behind to preserve total weight
+                const size_t odd = level.size() % 2;
+                random_state ^= random_state << 13;
+                random_state ^= random_state >> 7;
+                random_state ^= random_state << 17;
+                for (size_t i = odd + (random_state & 1); i < level.size(); i += 2) next.push_back(level[i]);
+
+                retained -= level.size() - odd - (level.size() - odd) / 2;
+                level.resize(odd);
+                return;
+            }
+        }
+
+        template<class T>
+        static void append(std::string &bytes, const T &value) {
+            bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+
+        template<class T>
+        static T extract(const std::string &bytes, size_t &offset) {
+            if (offset + sizeof(T) > bytes.size()) throw std::runtime_error("Malformed Perf::QuantileSketch");
+            T value;
+            std::memcpy(&value, bytes.data() + offset, sizeof(T));
+            offset += sizeof(T);
+            return value;
+        }
+    };
+
+    /**
+     * Distribution of measurements of a single code region, i.e., one
+     * QuantileSketch for elapsed time and each measured event. Use instead
+     * of storing every single measurement of long running regions.
+     */
+    struct Distribution {
+        /**
+         * @param k accuracy parameter of the underlying sketches, see QuantileSketch
+         */
+        explicit Distribution(const uint32_t k = 200) : k(k), time(k) {}
+
+        /// Adds a single measurement
+        template<class D>
+        void add(const Measurement<D> &measurement) {
+            time.add(static_cast<double>(measurement.time_delta_ns));
+            for (const auto &[event, value] : measurement.data) {
+                auto it = events.find(event);
+                if (it == events.end()) it = events.emplace(event, QuantileSketch(k)).first;
+                it->second.add(static_cast<double>(value));
+            }
+        }
+
+        /// Merges other into this distribution, e.g., from another thread
+        void merge(const Distribution &other) {
+            time.merge(other.time);
+            for (const auto &[event, sketch] : other.events) {
+                auto it = events.find(event);
+                if (it == events.end()) it = events.emplace(event, QuantileSketch(k)).first;
+                it->second.merge(sketch);
+            }
+        }
+
+        /// Estimated q-quantile of event, NaN if event was never measured
+        double quantile(const Event &event, const double q) const {
+            const auto it = events.find(event);
+            return it == events.end() ? std::numeric_limits<double>::quiet_NaN() : it->second.quantile(q);
+        }
+
+        /// Estimated q-quantile of elapsed time in nanoseconds
+        double time_quantile(const double q) const { return time.quantile(q); }
+
+        /// Amount of measurements added to this distribution
+        uint64_t size() const { return time.size(); }
+
+        /**
+         * Pretty print p50, p90, p99 and p999 of elapsed time and each
+         * event as a table with one row per metric
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+            std::cout << std::setw(column_width) << "Metric" << std::setw(column_width) << "p50"
+                      << std::setw(column_width) << "p90" << std::setw(column_width) << "p99"
+                      << std::setw(column_width) << "p999" << std::endl;
+
+            std::cout << std::setw(column_width) << "Elapsed [ns]";
+            for (const auto q : quantiles) std::cout << std::setw(column_width) << std::to_string(time.quantile(q));
+            std::cout << std::endl;
+
+            for (const auto &[event, sketch] : events) {
+                std::cout << std::setw(column_width) << human_readable_name(event);
+                for (const auto q : quantiles) {
+                    std::cout << std::setw(column_width) << std::to_string(sketch.quantile(q));
+                }
+                std::cout << std::endl;
+            }
+        }
+
+        /// Serializes this distribution, e.g., for merging across processes
+        std::string serialize() const {
+            std::string bytes;
+            const auto append_sketch = [&](const QuantileSketch &sketch) {
+                const auto serialized = sketch.serialize();
+                const auto size = static_cast<uint64_t>(serialized.size());
+                bytes.append(reinterpret_cast<const char *>(&size), sizeof(size));
+                bytes.append(serialized);
+            };
+
+            const auto event_count = static_cast<uint32_t>(events.size());
+            bytes.append(reinterpret_cast<const char *>(&k), sizeof(k));
+            bytes.append(reinterpret_cast<const char *>(&event_count), sizeof(event_count));
+            append_sketch(time);
+            for (const auto &[event, sketch] : events) {
+                bytes.append(reinterpret_cast<const char *>(&event), sizeof(event));
+                append_sketch(sketch);
+            }
+            return bytes;
+        }
+
+        /// Deserializes a distribution obtained via serialize()
+        static Distribution deserialize(const std::string &bytes) {
+            size_t offset = 0;
+            const auto extract = [&](void *target, const size_t size) {
+                if (offset + size > bytes.size()) throw std::runtime_error("Malformed Perf::Distribution");
+                std::memcpy(target, bytes.data() + offset, size);
+                offset += size;
+            };
+            const auto extract_sketch = [&] {
+                uint64_t size;
+                extract(&size, sizeof(size));
+                if (offset + size > bytes.size()) throw std::runtime_error("Malformed Perf::Distribution");
+                const auto sketch = QuantileSketch::deserialize(bytes.substr(offset, size));
+                offset += size;
+                return sketch;
+            };
+
+            uint32_t k, event_count;
+            extract(&k, sizeof(k));
+            extract(&event_count, sizeof(event_count));
+
+            Distribution distribution(k);
+            distribution.time = extract_sketch();
+            for (uint32_t i = 0; i < event_count; i++) {
+                Event event;
+                extract(&event, sizeof(event));
+                distribution.events.emplace(event, extract_sketch());
+            }
+            return distribution;
+        }
+
+    private:
+        uint32_t k;
+        QuantileSketch time;
+        std::unordered_map<Event, QuantileSketch> events;
+    };
+
+    /**
+     * Fixed size, trivially copyable representation of a labeled
+     * Measurement<uint64_t>, e.g., for persisting or queueing measurements
+     * without any allocations.
+     */
+    struct Record {
+        static constexpr size_t max_events = 12;
+        static constexpr size_t max_label_length = 55;
+
+        /// Wall clock time at which the record was created, nanoseconds since epoch
+        uint64_t timestamp_ns;
+        double time_delta_ns;
+        uint32_t event_count;
+        uint32_t events[max_events];
+        uint64_t values[max_events];
+        char label[max_label_length + 1];
+
+        /**
+         * Creates a record from a measurement. Events beyond max_events are
+         * dropped and labels longer than max_label_length are truncated.
+         *
+         * @param measurement measurement to store
+         * @param label optional label, e.g., the name of the measured region
+         */
+        static Record from(const Measurement<uint64_t> &measurement, const std::string_view label = {}) {
+            Record record{};
+            record.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::system_clock::now().time_since_epoch())
+                                          .count();
+            record.time_delta_ns = static_cast<double>(measurement.time_delta_ns);
+            for (const auto &[event, value] : measurement.data) {
+                if (record.event_count == max_events) break;
+                record.events[record.event_count] = static_cast<uint32_t>(event);
+                record.values[record.event_count] = value;
+                record.event_count++;
+            }
+            std::memcpy(record.label, label.data(), std::min(label.size(), max_label_length));
+            return record;
+        }
+
+        /// Reconstructs the stored measurement
+        Measurement<uint64_t> measurement() const {
+            std::unordered_map<Event, uint64_t> data;
+            for (size_t i = 0; i < std::min<size_t>(event_count, max_events); i++) {
+                data.emplace(static_cast<Event>(events[i]), values[i]);
+            }
+            return Measurement(data, time_delta_ns);
+        }
+
+        std::string_view name() const { return std::string_view(label, strnlen(label, max_label_length + 1)); }
+    };
+
+#ifndef PERF_MACOS_DISABLE
+    /**
+     * Crash safe, memory mapped append log of Records for always-on counter
+     * collection. Records are written into fixed size slots of memory mapped
+     * segment files. Since mappings are shared, the kernel persists all written
+     * pages even if the process crashes (use sync() to also survive power loss).
+     *
+     * Appending reserves a slot by bumping an atomic offset, copies the record
+     * and finally publishes a checksummed commit marker, i.e., is lock free
+     * and safe to call from multiple threads. When a segment is full, a new
+     * segment is started and the oldest segment beyond max_segments is deleted,
+     * which bounds disk usage to max_segments * segment_bytes.
+     *
+     * Use recover() to read back all complete records, e.g., after a crash.
+     */
+    struct MeasurementLog {
+        /**
+         * Opens a log in directory, which is created if necessary. Existing
+         * segments are kept (subject to max_segments) and appends continue in
+         * a new segment.
+         *
+         * @param directory directory containing the segment files
+         * @param segment_bytes size of each segment file
+         * @param max_segments maximum amount of segments kept on disk, at least 2
+         */
+        explicit MeasurementLog(const std::filesystem::path &directory, const size_t segment_bytes = 64ull << 20,
+                                const size_t max_segments = 16)
+            : directory(directory), slots_per_segment(std::max<size_t>(1, segment_bytes / sizeof(Slot))),
+              max_segments(std::max<size_t>(2, max_segments)) {
+            std::filesystem::create_directories(directory);
+
+            uint64_t next_sequence = 0;
+            for (const auto &[sequence, path] : segment_files(directory)) {
+                retained_files.push_back(path);
+                next_sequence = sequence + 1;
+            }
+            rotate(next_sequence, 0);
+        }
+
+        ~MeasurementLog() {
+            for (const auto &segment : segments) munmap(segment->slots, segment->slot_count * sizeof(Slot));
+            for (const auto &segment : retired) munmap(segment->slots, segment->slot_count * sizeof(Slot));
+        }
+
+        MeasurementLog(const MeasurementLog &) = delete;
+        MeasurementLog &operator=(const MeasurementLog &) = delete;
+
+        /**
+         * Appends a record. Lock free unless the current segment is full
+         */
+        forceinline void append(const Record &record) {
+            // Announced before loading current, i.e., evicted segments stay mapped while this append may reach them
+            appending.fetch_add(1, std::memory_order_seq_cst);
+            const Announcement announcement{appending};
+
+            while (true) {
+                auto *segment = current.load(std::memory_order_seq_cst);
+                const auto slot = segment->next.fetch_add(1, std::memory_order_relaxed);
+                if (slot < segment->slot_count) {
+                    auto &target = segment->slots[slot];
+                    std::memcpy(&target.record, &record, sizeof(Record));
+                    target.checksum = checksum(record);
+                    __atomic_store_n(&target.commit, commit_marker, __ATOMIC_RELEASE);
+                    return;
+                }
+
+                // Segment is full. The first thread to get here starts a new one
+                std::lock_guard<std::mutex> lock(rotate_mutex);
+                if (current.load(std::memory_order_acquire) == segment) rotate(segment->sequence + 1, 1);
+            }
+        }
+
+        /**
+         * Convenience wrapper, see Record::from()
+         */
+        void append(const Measurement<uint64_t> &measurement, const std::string_view label = {}) {
+            append(Record::from(measurement, label));
+        }
+
+        /**
+         * Synchronously flushes all mapped segments to disk. Not required to
+         * survive process crashes, only to survive power loss or kernel panics
+         */
+        void sync() {
+            std::lock_guard<std::mutex> lock(rotate_mutex);
+            for (const auto &segment : segments) {
+                msync(segment->slots, segment->slot_count * sizeof(Slot), MS_SYNC);
+            }
+        }
+
+        /**
+         * Scans all segments in directory in order and returns every complete
+         * (committed and checksum verified) record. Slots that were reserved
+         * but not completely written, e.g., due to a crash, are skipped.
+         *
+         * @param directory log directory
+         * @return all complete records, oldest first. The last entry is the last complete record
+         */
+        static std::vector<Record> recover(const std::filesystem::path &directory) {
+            std::vector<Record> records;
+            for (const auto &[sequence, path] : segment_files(directory)) {
+                const int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0) continue;
+
+                const auto bytes = static_cast<size_t>(lseek(fd, 0, SEEK_END));
+                const auto slot_count = bytes / sizeof(Slot);
+                if (slot_count == 0) {
+                    close(fd);
+                    continue;
+                }
+
+                auto *slots = static_cast<const Slot *>(mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0));
+                close(fd);
+                if (slots == MAP_FAILED) continue;
+
+                for (size_t i = 0; i < slot_count; i++) {
+                    const auto &slot = slots[i];
+                    if (__atomic_load_n(&slot.commit, __ATOMIC_ACQUIRE) != commit_marker) continue;
+                    if (slot.checksum != checksum(slot.record)) continue;
+                    records.push_back(slot.record);
+                }
+                munmap(const_cast<Slot *>(slots), bytes);
+            }
+            return records;
+        }
+
+    private:
+        static constexpr uint64_t commit_marker = 0x5045524D4143524Cull;// "PERMACRL"
+
+        struct alignas(64) Slot {
+            uint64_t commit;
+            uint64_t checksum;
+            Record record;
+        };
+
+        struct Segment {
+            uint64_t sequence;
+            Slot *slots;
+            size_t slot_count;
+            std::atomic<uint64_t> next{0};
+        };
+
+        /// Withdraws an append's announcement, also if rotating throws
+        struct Announcement {
+            std::atomic<size_t> &appending;
+            ~Announcement() { appending.fetch_sub(1, std::memory_order_release); }
+        };
+
+        const std::filesystem::path directory;
+        const size_t slots_per_segment;
+        const size_t max_segments;
+
+        std::mutex rotate_mutex;
+        std::atomic<Segment *> current = nullptr;
+        /// Appends in progress, see rotate()
+        std::atomic<size_t> appending = 0;
+        /// Mapped segments, oldest first
+        std::deque<std::unique_ptr<Segment>> segments;
+        /// Evicted segments whose files are deleted but which appends may still reach, i.e., are still mapped
+        std::vector<std::unique_ptr<Segment>> retired;
+        /// Segment files from previous runs, oldest first
+        std::deque<std::filesystem::path> retained_files;
+
+        static uint64_t checksum(const Record &record) {
+            // FNV-1a
+            uint64_t hash = 0xCBF29CE484222325ull;
+            const auto *bytes = reinterpret_cast<const unsigned char *>(&record);
+            for (size_t i = 0; i < sizeof(Record); i++) hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+            return hash;
+        }
+
+        static std::filesystem::path segment_path(const std::filesystem::path &directory, const uint64_t sequence) {
+            char name[32];
+            snprintf(name, sizeof(name), "segment-%016llx.log", static_cast<unsigned long long>(sequence));
+            return directory / name;
+        }
+
+        static std::vector<std::pair<uint64_t, std::filesystem::path>>
+        segment_files(const std::filesystem::path &directory) {
+            std::vector<std::pair<uint64_t, std::filesystem::path>> files;
+            if (!std::filesystem::is_directory(directory)) return files;
+
+            for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+                unsigned long long sequence;
+                if (sscanf(entry.path().filename().c_str(), "segment-%llx.log", &sequence) != 1) continue;
+                files.emplace_back(sequence, entry.path());
+            }
+            std::sort(files.begin(), files.end());
+            return files;
+        }
+
+        /**
+         * Starts a new segment and evicts the oldest ones
+         *
+         * @param sequence sequence number of the new segment
+         * @param own_appends appends announced by the calling thread
+         */
+        void rotate(const uint64_t sequence, const size_t own_appends) {
+            const auto path = segment_path(directory, sequence);
+            const auto bytes = slots_per_segment * sizeof(Slot);
+
+            const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) throw std::runtime_error("Could not create measurement log segment " + path.string());
+            if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+                close(fd);
+                throw std::runtime_error("Could not size measurement log segment " + path.string());
+            }
+            void *slots = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (slots == MAP_FAILED) throw std::runtime_error("Could not map measurement log segment " + path.string());
+
+            auto segment = std::make_unique<Segment>();
+            segment->sequence = sequence;
+            segment->slots = static_cast<Slot *>(slots);
+            segment->slot_count = slots_per_segment;
+            current.store(segment.get(), std::memory_order_seq_cst);
+            segments.push_back(std::move(segment));
+
+            // Bound disk usage by evicting the oldest segments
+            while (retained_files.size() + segments.size() > max_segments) {
+                if (!retained_files.empty()) {
+                    std::filesystem::remove(retained_files.front());
+                    retained_files.pop_front();
+                    continue;
+                }
+                // Appends that loaded current before it moved on may still write to the evicted segment
+                std::filesystem::remove(segment_path(directory, segments.front()->sequence));
+                retired.push_back(std::move(segments.front()));
+                segments.pop_front();
+            }
+
+            // Appends announced after current was stored above only reach segments that are not evicted yet.
+            // Without other announced appends, no append can reach any retired segment
+            if (appending.load(std::memory_order_seq_cst) <= own_appends) {
+                for (const auto &evicted : retired) munmap(evicted->slots, evicted->slot_count * sizeof(Slot));
+                retired.clear();
+            }
+        }
+    };
+#else
+    /**
+     * Perf::MeasurementLog with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Neither creates nor writes any segment, recover() finds no records.
+     */
+    struct MeasurementLog {
+        explicit MeasurementLog(const std::filesystem::path &, const size_t = 64ull << 20, const size_t = 16) {}
+
+        void append(const Record &) {}
+        void append(const Measurement<uint64_t> &, const std::string_view = {}) {}
+        void sync() {}
+        static std::vector<Record> recover(const std::filesystem::path &) { return {}; }
+    };
+#endif
+
+    /**
+     * Compressed, append-only series of 64-bit values such as timestamps or
+     * monotonic counter snapshots.
+     *
+     * Values are delta-of-delta encoded and written with Gorilla-style prefix
+     * codes (Pelkonen et al., "Gorilla: A Fast, Scalable, In-Memory Time
+     * Series Database", 2015), i.e., perfectly regular series cost a single
+     * bit per value. The series is split into independently decodable blocks
+     * of block_size values for random access.
+     */
+    struct CompressedSeries {
+        /**
+         * @param block_size amount of values per independently decodable block
+         */
+        explicit CompressedSeries(const size_t block_size = 1024) : block_size(std::max<size_t>(1, block_size)) {
+            words.push_back(0);
+        }
+
+        /// Appends a value to the series
+        void append(const uint64_t value) {
+            if (count % block_size == 0) {
+                // Blocks start word aligned with the raw first value
+                bit_position = (bit_position + 63) / 64 * 64;
+                block_offsets.push_back(bit_position / 64);
+                write(value, 64);
+                previous_delta = 0;
+            } else {
+                // Modular arithmetic, i.e., arbitrary jumps (e.g., counter resets) round trip without overflow
+                const auto delta = value - previous;
+                const auto delta_of_delta = delta - previous_delta;
+                // zigzag encode such that small negative values are small as well
+                const auto zigzag =
+                        (delta_of_delta << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(delta_of_delta) >> 63);
+
+                size_t bucket = 0;
+                while (bucket + 1 < buckets && (bucket_bits[bucket] == 64 || zigzag >= (1ull << bucket_bits[bucket]))) {
+                    bucket++;
+                }
+                // Prefix code: bucket ones followed by a zero (omitted for the last bucket)
+                if (bucket + 1 < buckets) {
+                    write(((1ull << bucket) - 1) << 1, bucket + 1);
+                } else {
+                    write((1ull << bucket) - 1, bucket);
+                }
+                if (bucket_bits[bucket] > 0) write(zigzag, bucket_bits[bucket]);
+                previous_delta = delta;
+            }
+            previous = value;
+            count++;
+        }
+
+        /// Amount of values in the series
+        size_t size() const { return count; }
+
+        /// Amount of independently decodable blocks
+        size_t blocks() const { return block_offsets.size(); }
+
+        /// Size of the encoded series in bytes
+        size_t compressed_bytes() const {
+            return (bit_position + 7) / 8 + block_offsets.size() * sizeof(size_t);
+        }
+
+        /**
+         * Decodes a single block
+         *
+         * @param block block index, < blocks()
+         * @param out buffer receiving at most block_size values
+         * @return amount of decoded values
+         */
+        size_t decode_block(const size_t block, uint64_t *out) const {
+            const auto n = std::min(block_size, count - block * block_size);
+            decode_values(block, n, [&](const size_t i, const uint64_t value) { out[i] = value; });
+            return n;
+        }
+
+        /// Random access to a single value. Decodes its block up to index
+        uint64_t operator[](const size_t index) const {
+            uint64_t result = 0;
+            decode_values(index / block_size, index % block_size + 1,
+                          [&](const size_t, const uint64_t value) { result = value; });
+            return result;
+        }
+
+        /// Decodes the entire series
+        std::vector<uint64_t> decode() const {
+            std::vector<uint64_t> values(count + block_size);
+            for (size_t b = 0; b < blocks(); b++) decode_block(b, values.data() + b * block_size);
+            values.resize(count);
+            return values;
+        }
+
+    private:
+        static constexpr size_t buckets = 6;
+        static constexpr unsigned int bucket_bits[buckets] = {0, 4, 12, 20, 32, 64};
+
+        const size_t block_size;
+        size_t count = 0;
+        uint64_t previous = 0;
+        uint64_t previous_delta = 0;
+
+        /// Bit stream (msb first). Always contains a trailing zero word to simplify peek()
+        std::vector<uint64_t> words;
+        size_t bit_position = 0;
+        std::vector<size_t> block_offsets;
+
+        /// Decodes the first n values of block, passing each to emit(index within block, value)
+        template<class F>
+        forceinline void decode_values(const size_t block, const size_t n, F &&emit) const {
+            size_t position = block_offsets[block] * 64;
+
+            uint64_t value = read(position, 64);
+            uint64_t delta = 0;
+            emit(0, value);
+            for (size_t i = 1; i < n; i++) {
+                // Count leading ones of the prefix code
+                const auto window = peek(position);
+                const size_t ones = ~window == 0 ? 64 : __builtin_clzll(~window);
+                const size_t bucket = std::min(ones, buckets - 1);
+                const size_t prefix = bucket + (bucket + 1 < buckets ? 1 : 0);
+                const auto bits = bucket_bits[bucket];
+
+                // Except for the last bucket, prefix and payload are contained in window
+                uint64_t zigzag;
+                if (bits == 0) {
+                    zigzag = 0;
+                    position += prefix;
+                } else if (prefix + bits <= 64) {
+                    zigzag = (window << prefix) >> (64 - bits);
+                    position += prefix + bits;
+                } else {
+                    position += prefix;
+                    zigzag = read(position, bits);
+                }
+                delta += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+                value += delta;
+                emit(i, value);
+            }
+        }
+
+        void write(const uint64_t value, const unsigned int bits) {
+            const auto offset = bit_position % 64;
+            const auto masked = bits == 64 ? value : value & ((1ull << bits) - 1);
+            while (words.size() < (bit_position + bits) / 64 + 2) words.push_back(0);
+
+            const auto free_bits = 64 - offset;
+            if (bits <= free_bits) {
+                words[bit_position / 64] |= bits == 64 ? masked : masked << (free_bits - bits);
+            } else {
+                words[bit_position / 64] |= masked >> (bits - free_bits);
+                words[bit_position / 64 + 1] |= masked << (64 - (bits - free_bits));
+            }
+            bit_position += bits;
+        }
+
+        forceinline uint64_t peek(const size_t position) const {
+            const auto offset = position % 64;
+            const auto word = position / 64;
+            return offset == 0 ? words[word] : (words[word] << offset) | (words[word + 1] >> (64 - offset));
+        }
+
+        forceinline uint64_t read(size_t &position, const unsigned int bits) const {
+            if (bits == 0) return 0;
+            const auto value = peek(position) >> (64 - bits);
+            position += bits;
+            return value;
+        }
+    };
+
+    /**
+     * Compressed series of periodic counter snapshots, e.g., per-second
+     * process counters. Timestamps and each event's (monotonic) counter
+     * values are stored as CompressedSeries.
+     */
+    struct CounterSeries {
+        /**
+         * @param events events contained in each snapshot
+         * @param block_size amount of snapshots per independently decodable block
+         */
+        explicit CounterSeries(const std::vector<Event> &events, const size_t block_size = 1024)
+            : events(events), timestamps(block_size) {
+            for (size_t i = 0; i < events.size(); i++) values.emplace_back(block_size);
+        }
+
+        /**
+         * Appends a snapshot. Events missing from the snapshot are recorded as 0
+         *
+         * @param timestamp_ns snapshot time, e.g., nanoseconds since epoch
+         * @param snapshot (cumulative) counter values
+         */
+        void append(const uint64_t timestamp_ns, const Measurement<uint64_t> &snapshot) {
+            timestamps.append(timestamp_ns);
+            for (size_t i = 0; i < events.size(); i++) {
+                const auto it = snapshot.data.find(events[i]);
+                values[i].append(it == snapshot.data.end() ? 0 : it->second);
+            }
+        }
+
+        /// Amount of snapshots
+        size_t size() const { return timestamps.size(); }
+
+        /// Encoded size in bytes
+        size_t compressed_bytes() const {
+            size_t bytes = timestamps.compressed_bytes();
+            for (const auto &series : values) bytes += series.compressed_bytes();
+            return bytes;
+        }
+
+        /// Size in bytes of storing all snapshots as raw 64-bit values
+        size_t raw_bytes() const { return size() * (events.size() + 1) * sizeof(uint64_t); }
+
+        const CompressedSeries &timestamp_series() const { return timestamps; }
+
+        /// Compressed series of a single event, throws if event is not part of this series
+        const CompressedSeries &event_series(const Event &event) const {
+            for (size_t i = 0; i < events.size(); i++) {
+                if (events[i] == event) return values[i];
+            }
+            throw std::runtime_error("Event is not part of this Perf::CounterSeries");
+        }
+
+        /**
+         * Reconstructs the measurement between snapshots from and to
+         *
+         * @param from index of earlier snapshot
+         * @param to index of later snapshot
+         */
+        Measurement<uint64_t> between(const size_t from, const size_t to) const {
+            std::unordered_map<Event, uint64_t> data;
+            for (size_t i = 0; i < events.size(); i++) data.emplace(events[i], values[i][to] - values[i][from]);
+            return Measurement(data, static_cast<long double>(timestamps[to] - timestamps[from]));
+        }
+
+    private:
+        std::vector<Event> events;
+        CompressedSeries timestamps;
+        std::vector<CompressedSeries> values;
+    };
+
+    /**
+     * Columnar storage of labeled measurements, queryable via Perf::Query.
+     *
+     * Labels are stored as dictionary encoded string columns. Elapsed time
+     * ("time_ns") and each event (by identifier, e.g., "llc_misses") are
+     * stored as numeric columns. Values missing from a row are NaN (numeric)
+     * or the empty string (labels).
+     */
+    struct ResultTable {
+        /**
+         * Appends a row
+         *
+         * @param measurement counter values and elapsed time of the row
+         * @param labels (column, value) pairs, e.g., {{"region", "probe"}, {"build", "a1b2c3"}}
+         */
+        void add(const Measurement<uint64_t> &measurement,
+                 const std::vector<std::pair<std::string, std::string>> &labels = {}) {
+            numeric_column("time_ns").push_back(static_cast<double>(measurement.time_delta_ns));
+            for (const auto &[event, value] : measurement.data) {
+                numeric_column(identifier(event)).push_back(static_cast<double>(value));
+            }
+            for (const auto &[name, value] : labels) {
+                auto &column = label_column(name);
+                column.codes.push_back(column.encode(value));
+            }
+
+            // Pad columns missing from this row
+            rows++;
+            for (auto &column : numerics) column.resize(rows, std::numeric_limits<double>::quiet_NaN());
+            for (auto &column : labels_columns) column.codes.resize(rows, column.encode(""));
+        }
+
+        /**
+         * Appends a row from a record. Record labels of the form "key=value,key=value"
+         * are split into columns. Other labels are stored in column "label".
+         */
+        void add(const Record &record) {
+            std::vector<std::pair<std::string, std::string>> labels;
+            const auto label = record.name();
+            if (label.find('=') == std::string_view::npos) {
+                if (!label.empty()) labels.emplace_back("label", std::string(label));
+            } else {
+                size_t begin = 0;
+                while (begin < label.size()) {
+                    auto end = label.find(',', begin);
+                    if (end == std::string_view::npos) end = label.size();
+                    const auto pair = label.substr(begin, end - begin);
+                    const auto separator = pair.find('=');
+                    if (separator != std::string_view::npos) {
+                        labels.emplace_back(std::string(pair.substr(0, separator)),
+                                            std::string(pair.substr(separator + 1)));
+                    }
+                    begin = end + 1;
+                }
+            }
+            add(record.measurement(), labels);
+        }
+
+        /// Loads all complete records of a Perf::MeasurementLog
+        static ResultTable from_log(const std::filesystem::path &directory) {
+            ResultTable table;
+            for (const auto &record : MeasurementLog::recover(directory)) table.add(record);
+            return table;
+        }
+
+        /// Amount of rows
+        size_t size() const { return rows; }
+
+        bool is_numeric(const std::string &column) const { return find(numeric_names, column) < numerics.size(); }
+        bool is_label(const std::string &column) const { return find(label_names, column) < labels_columns.size(); }
+
+        /// Values of a numeric column, throws for unknown columns
+        const std::vector<double> &numeric(const std::string &column) const {
+            const auto index = find(numeric_names, column);
+            if (index == numerics.size()) throw std::invalid_argument("Unknown numeric column: " + column);
+            return numerics[index];
+        }
+
+        /// Dictionary codes of a label column, throws for unknown columns
+        const std::vector<uint32_t> &codes(const std::string &column) const { return label(column).codes; }
+
+        /// Dictionary of a label column, i.e., the value of each code
+        const std::vector<std::string> &dictionary(const std::string &column) const {
+            return label(column).dictionary;
+        }
+
+        const std::vector<std::string> &numeric_columns() const { return numeric_names; }
+        const std::vector<std::string> &label_columns() const { return label_names; }
+
+    private:
+        struct LabelColumn {
+            std::vector<uint32_t> codes;
+            std::vector<std::string> dictionary;
+            std::unordered_map<std::string, uint32_t> lookup;
+
+            uint32_t encode(const std::string &value) {
+                const auto [it, inserted] = lookup.emplace(value, dictionary.size());
+                if (inserted) dictionary.push_back(value);
+                return it->second;
+            }
+        };
+
+        size_t rows = 0;
+        std::vector<std::string> numeric_names;
+        std::vector<std::vector<double>> numerics;
+        std::vector<std::string> label_names;
+        std::vector<LabelColumn> labels_columns;
+
+        static size_t find(const std::vector<std::string> &names, const std::string &name) {
+            return std::find(names.begin(), names.end(), name) - names.begin();
+        }
+
+        std::vector<double> &numeric_column(const std::string &name) {
+            const auto index = find(numeric_names, name);
+            if (index < numerics.size()) return numerics[index];
+            numeric_names.push_back(name);
+            return numerics.emplace_back(rows, std::numeric_limits<double>::quiet_NaN());
+        }
+
+        LabelColumn &label_column(const std::string &name) {
+            const auto index = find(label_names, name);
+            if (index < labels_columns.size()) return labels_columns[index];
+            label_names.push_back(name);
+            auto &column = labels_columns.emplace_back();
+            column.codes.resize(rows, column.encode(""));
+            return column;
+        }
+
+        const LabelColumn &label(const std::string &name) const {
+            const auto index = find(label_names, name);
+            if (index == labels_columns.size()) throw std::invalid_argument("Unknown label column: " + name);
+            return labels_columns[index];
+        }
+    };
+
+    /// Result of a Perf::Query, one row per group
+    struct QueryResult {
+        std::vector<std::string> group_columns;
+        std::vector<std::string> aggregate_columns;
+        std::vector<std::vector<std::string>> keys;
+        std::vector<std::vector<double>> values;
+
+        /**
+         * Pretty print this result as a table with one row per group
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            for (const auto &column : group_columns) std::cout << std::setw(column_width) << column;
+            for (const auto &column : aggregate_columns) std::cout << std::setw(column_width) << column;
+            std::cout << std::endl;
+
+            for (size_t row = 0; row < keys.size(); row++) {
+                for (const auto &key : keys[row]) std::cout << std::setw(column_width) << key;
+                for (const auto value : values[row]) std::cout << std::setw(column_width) << std::to_string(value);
+                std::cout << std::endl;
+            }
+        }
+    };
+
+    /**
+     * Filter, group-by and aggregate queries over a Perf::ResultTable, e.g.,
+     * "p99 cycles of region X grouped by build where llc_misses > N":
+     *
+     *   Perf::Query(table).where("region=X").where("llc_misses>1000").group_by("build").select("p99(cycles)").run()
+     *
+     * Filters are evaluated column at a time into a selection mask, i.e., as
+     * tight loops over contiguous columns. Percentiles are exact.
+     */
+    struct Query {
+        enum Comparison { equal, not_equal, less, less_equal, greater, greater_equal };
+        enum Aggregate { count, sum, min, max, avg, quantile };
+
+        explicit Query(const ResultTable &table) : table(table) {}
+
+        /// Keeps rows whose numeric column compares true against value. NaN never matches
+        Query &where(const std::string &column, const Comparison comparison, const double value) {
+            table.numeric(column);
+            numeric_filters.push_back({column, comparison, value});
+            return *this;
+        }
+
+        /// Keeps rows whose label column is (not) equal to value
+        Query &where(const std::string &column, const Comparison comparison, const std::string &value) {
+            table.codes(column);
+            if (comparison != equal && comparison != not_equal) {
+                throw std::invalid_argument("Label columns only support = and !=");
+            }
+            label_filters.push_back({column, comparison, value});
+            return *this;
+        }
+
+        /// Parses and adds a condition of the form "<column><op><value>" with op in =, !=, <, <=, >, >=
+        Query &where(const std::string &condition) {
+            const std::pair<const char *, Comparison> operators[] = {{"!=", not_equal}, {">=", greater_equal},
+                                                                     {"<=", less_equal}, {"=", equal},
+                                                                     {">", greater},     {"<", less}};
+            for (const auto &[op, comparison] : operators) {
+                const auto position = condition.find(op);
+                if (position == std::string::npos) continue;
+
+                const auto column = trim(condition.substr(0, position));
+                const auto value = trim(condition.substr(position + strlen(op)));
+                if (table.is_label(column)) return where(column, comparison, value);
+                return where(column, comparison, std::stod(value));
+            }
+            throw std::invalid_argument("Malformed condition: " + condition);
+        }
+
+        /// Groups by a label column. May be called multiple times
+        Query &group_by(const std::string &column) {
+            table.codes(column);
+            groups.push_back(column);
+            return *this;
+        }
+
+        /**
+         * Adds an aggregate to the result
+         *
+         * @param aggregate aggregate function
+         * @param column numeric column, ignored for count
+         * @param q quantile within [0, 1], only used for Aggregate::quantile
+         */
+        Query &select(const Aggregate aggregate, const std::string &column = "", const double q = 0) {
+            if (aggregate != count) table.numeric(column);
+            aggregates.push_back({aggregate, column, q});
+            return *this;
+        }
+
+        /// Parses and adds an aggregate expression such as "count()", "avg(time_ns)" or "p99(cycles)"
+        Query &select(const std::string &expression) {
+            const auto open = expression.find('(');
+            const auto close = expression.rfind(')');
+            if (open == std::string::npos || close == std::string::npos || close < open) {
+                throw std::invalid_argument("Malformed aggregate: " + expression);
+            }
+            const auto function = trim(expression.substr(0, open));
+            const auto column = trim(expression.substr(open + 1, close - open - 1));
+
+            if (function == "count") return select(count);
+            if (function == "sum") return select(sum, column);
+            if (function == "min") return select(min, column);
+            if (function == "max") return select(max, column);
+            if (function == "avg") return select(avg, column);
+            if (function.size() > 1 && function[0] == 'p' &&
+                std::all_of(function.begin() + 1, function.end(), [](const char c) { return isdigit(c); })) {
+                // p50 -> 0.5, p99 -> 0.99, p999 -> 0.999
+                const auto digits = function.substr(1);
+                return select(quantile, column, std::stod(digits) / std::pow(10.0, digits.size()));
+            }
+            throw std::invalid_argument("Unknown aggregate: " + function);
+        }
+
+        /// Executes the query
+        QueryResult run() const {
+            const auto rows = table.size();
+
+            // Filters (vectorizable scans into a selection mask)
+            std::vector<uint8_t> selected(rows, 1);
+            for (const auto &filter : numeric_filters) scan(table.numeric(filter.column), filter, selected);
+            for (const auto &filter : label_filters) {
+                const auto &codes = table.codes(filter.column);
+                const auto &dictionary = table.dictionary(filter.column);
+                const auto code = static_cast<uint32_t>(
+                        std::find(dictionary.begin(), dictionary.end(), filter.value) - dictionary.begin());
+                const uint8_t match = filter.comparison == equal;
+                for (size_t i = 0; i < rows; i++) selected[i] &= (codes[i] == code) == match;
+            }
+
+            // Group ids via mixed radix composition of dictionary codes
+            std::vector<const std::vector<uint32_t> *> group_codes;
+            std::vector<uint64_t> radices;
+            for (const auto &column : groups) {
+                group_codes.push_back(&table.codes(column));
+                radices.push_back(table.dictionary(column).size());
+            }
+
+            std::unordered_map<uint64_t, uint32_t> group_ids;
+            std::vector<uint64_t> group_keys;
+            std::vector<uint32_t> group_of(rows, 0);
+            for (size_t i = 0; i < rows; i++) {
+                if (!selected[i]) continue;
+                uint64_t key = 0;
+                for (size_t g = 0; g < group_codes.size(); g++) key = key * radices[g] + (*group_codes[g])[i];
+
+                const auto [it, inserted] = group_ids.emplace(key, group_keys.size());
+                if (inserted) group_keys.push_back(key);
+                group_of[i] = it->second;
+            }
+
+            QueryResult result;
+            result.group_columns = groups;
+            for (const auto &aggregate : aggregates) result.aggregate_columns.push_back(aggregate.name());
+            for (auto key : group_keys) {
+                std::vector<std::string> values(groups.size());
+                for (size_t g = groups.size(); g-- > 0;) {
+                    values[g] = table.dictionary(groups[g])[key % radices[g]];
+                    key /= radices[g];
+                }
+                result.keys.push_back(values);
+            }
+
+            // Aggregates
+            const auto group_count = group_keys.size();
+            result.values.assign(group_count, std::vector<double>(aggregates.size()));
+            for (size_t a = 0; a < aggregates.size(); a++) {
+                const auto &aggregate = aggregates[a];
+                const auto aggregated = evaluate(aggregate, selected, group_of, group_count);
+                for (size_t g = 0; g < group_count; g++) result.values[g][a] = aggregated[g];
+            }
+
+            // Deterministic output order
+            std::vector<size_t> order(group_count);
+            for (size_t i = 0; i < group_count; i++) order[i] = i;
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return result.keys[a] < result.keys[b]; });
+            QueryResult sorted{result.group_columns, result.aggregate_columns, {}, {}};
+            for (const auto i : order) {
+                sorted.keys.push_back(result.keys[i]);
+                sorted.values.push_back(result.values[i]);
+            }
+            return sorted;
+        }
+
+    private:
+        struct NumericFilter {
+            std::string column;
+            Comparison comparison;
+            double value;
+        };
+
+        struct LabelFilter {
+            std::string column;
+            Comparison comparison;
+            std::string value;
+        };
+
+        struct Selection {
+            Aggregate aggregate;
+            std::string column;
+            double q;
+
+            std::string name() const {
+                switch (aggregate) {
+                    case count:
+                        return "count()";
+                    case sum:
+                        return "sum(" + column + ")";
+                    case min:
+                        return "min(" + column + ")";
+                    case max:
+                        return "max(" + column + ")";
+                    case avg:
+                        return "avg(" + column + ")";
+                    default:
+                        char name[32];
+                        snprintf(name, sizeof(name), "p%g(", q * 100);
+                        return name + column + ")";
+                }
+            }
+        };
+
+        const ResultTable &table;
+        std::vector<NumericFilter> numeric_filters;
+        std::vector<LabelFilter> label_filters;
+        std::vector<std::string> groups;
+        std::vector<Selection> aggregates;
+
+        static std::string trim(const std::string &text) {
+            const auto begin = text.find_first_not_of(" \t");
+            const auto end = text.find_last_not_of(" \t");
+            return begin == std::string::npos ? "" : text.substr(begin, end - begin + 1);
+        }
+
+        static void scan(const std::vector<double> &column, const NumericFilter &filter, std::vector<uint8_t> &selected) {
+            const auto *values = column.data();
+            auto *mask = selected.data();
+            const auto rows = column.size();
+            const auto v = filter.value;
+
+            // One tight loop per comparison such that the compiler can vectorize each
+            switch (filter.comparison) {
+                case equal:
+                    for (size_t i = 0; i < rows; i++) mask[i] &= values[i] == v;
+                    break;
+                case not_equal:
+                    for (size_t i = 0; i < rows; i++) mask[i] &= values[i] != v && values[i] == values[i];
+                    break;
+                case less:
+                    for (size_t i = 0; i < rows; i++) mask[i] &= values[i] < v;
+                    break;
+                case less_equal:
+                    for (size_t i = 0; i < rows; i++) mask[i] &= values[i] <= v;
+                    break;
+                case greater:
+                    for (size_t i = 0; i < rows; i++) mask[i] &= values[i] > v;
+                    break;
+                case greater_equal:
+                    for (size_t i = 0; i < rows; i++) mask[i] &= values[i] >= v;
+                    break;
+            }
+        }
+
+        std::vector<double> evaluate(const Selection &selection, const std::vector<uint8_t> &selected,
+                                     const std::vector<uint32_t> &group_of, const size_t group_count) const {
+            const auto rows = selected.size();
+            std::vector<double> results(group_count, 0);
+            std::vector<uint64_t> counts(group_count, 0);
+
+            if (selection.aggregate == count) {
+                for (size_t i = 0; i < rows; i++) {
+                    if (selected[i]) results[group_of[i]]++;
+                }
+                return results;
+            }
+
+            const auto &values = table.numeric(selection.column);
+            if (selection.aggregate == quantile) {
+                std::vector<std::vector<double>> grouped(group_count);
+                for (size_t i = 0; i < rows; i++) {
+                    if (selected[i] && !std::isnan(values[i])) grouped[group_of[i]].push_back(values[i]);
+                }
+                for (size_t g = 0; g < group_count; g++) {
+                    auto &group = grouped[g];
+                    if (group.empty()) {
+                        results[g] = std::numeric_limits<double>::quiet_NaN();
+                        continue;
+                    }
+                    // Nearest rank, i.e., the smallest value with at least q of the group at or below it
+                    const auto nearest = std::ceil(selection.q * static_cast<double>(group.size())) - 1;
+                    const auto rank =
+                            static_cast<size_t>(std::clamp(nearest, 0.0, static_cast<double>(group.size() - 1)));
+                    std::nth_element(group.begin(), group.begin() + rank, group.end());
+                    results[g] = group[rank];
+                }
+                return results;
+            }
+
+            if (selection.aggregate == min) results.assign(group_count, std::numeric_limits<double>::infinity());
+            if (selection.aggregate == max) results.assign(group_count, -std::numeric_limits<double>::infinity());
+            for (size_t i = 0; i < rows; i++) {
+                if (!selected[i] || std::isnan(values[i])) continue;
+                auto &result = results[group_of[i]];
+                counts[group_of[i]]++;
+                switch (selection.aggregate) {
+                    case min:
+                        result = std::min(result, values[i]);
+                        break;
+                    case max:
+                        result = std::max(result, values[i]);
+                        break;
+                    default:
+                        result += values[i];
+                        break;
+                }
+            }
+            for (size_t g = 0; g < group_count; g++) {
+                if (counts[g] == 0) {
+                    results[g] = std::numeric_limits<double>::quiet_NaN();
+                } else if (selection.aggregate == avg) {
+                    results[g] /= static_cast<double>(counts[g]);
+                }
+            }
+            return results;
+        }
+    };
+
+    /**
+     * Lock free, intrusive multi-producer single-consumer queue
+     * (D. Vyukov, "Intrusive MPSC node-based queue").
+     *
+     * push() is wait free apart from a single atomic exchange. Nodes must
+     * derive from MPSCQueue::Node and stay alive until popped.
+     */
+    struct MPSCQueue {
+        struct Node {
+            std::atomic<Node *> next = nullptr;
+        };
+
+        MPSCQueue() : head(&stub), tail(&stub) {}
+
+        MPSCQueue(const MPSCQueue &) = delete;
+        MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+        /// Enqueues node. Safe to call from any thread
+        forceinline void push(Node *node) {
+            node->next.store(nullptr, std::memory_order_relaxed);
+            auto *previous = head.exchange(node, std::memory_order_acq_rel);
+            previous->next.store(node, std::memory_order_release);
+        }
+
+        /**
+         * Dequeues the oldest node. Must only be called from a single consumer thread
+         *
+         * @return oldest node or nullptr if the queue is empty (or a push is still in progress)
+         */
+        Node *pop() {
+            auto *current = tail;
+            auto *next = current->next.load(std::memory_order_acquire);
+            if (current == &stub) {
+                if (next == nullptr) return nullptr;
+                tail = next;
+                current = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next != nullptr) {
+                tail = next;
+                return current;
+            }
+            if (current != head.load(std::memory_order_acquire)) return nullptr;
+
+            push(&stub);
+            next = current->next.load(std::memory_order_acquire);
+            if (next != nullptr) {
+                tail = next;
+                return current;
+            }
+            return nullptr;
+        }
+
+    private:
+        Node stub;
+        std::atomic<Node *> head;
+        Node *tail;
+    };
+
+#ifndef PERF_MACOS_DISABLE
+    /**
+     * Collects records from many threads into a single aggregator thread
+     * without any synchronization on the hot path.
+     *
+     * Each thread records into its own, cache line aligned batch. Full batches
+     * are handed to the aggregator thread through a lock free MPSC queue, which
+     * invokes consumer for each batch, i.e., consumer never runs concurrently
+     * and may update unsynchronized state such as a Perf::Distribution or a
+     * Perf::ResultTable. Partially filled batches are flushed when their thread
+     * exits, on flush() and, for the destructing thread, on destruction.
+     * Batches of threads still running at destruction are lost, i.e., join
+     * (or flush()) all recording threads before destroying the aggregator.
+     */
+    struct Aggregator {
+        using Consumer = std::function<void(const Record *records, size_t count)>;
+
+        /**
+         * Starts the aggregator thread
+         *
+         * @param consumer invoked from the aggregator thread for each batch of records
+         * @param batch_size amount of records per thread-local batch
+         * @param poll_interval time the aggregator thread sleeps when the queue is empty
+         */
+        explicit Aggregator(Consumer consumer, const size_t batch_size = 256,
+                            const std::chrono::microseconds poll_interval = std::chrono::microseconds(500))
+            : shared(std::make_shared<Shared>(std::max<size_t>(1, batch_size))), consumer(std::move(consumer)),
+              poll_interval(poll_interval), thread([this] { run(); }) {}
+
+        /// Flushes the calling thread's batch, then drains all queued batches and stops the aggregator thread
+        ~Aggregator() {
+            flush();
+            shared->closed.store(true, std::memory_order_release);
+            thread.join();
+        }
+
+        Aggregator(const Aggregator &) = delete;
+        Aggregator &operator=(const Aggregator &) = delete;
+
+        /// Records a single record into the calling thread's batch
+        forceinline void record(const Record &record) {
+            auto *batch = local_batch();
+            batch->records[batch->count++] = record;
+            if (batch->count == shared->batch_size) publish();
+        }
+
+        /// Convenience wrapper, see Record::from()
+        void record(const Measurement<uint64_t> &measurement, const std::string_view label = {}) {
+            record(Record::from(measurement, label));
+        }
+
+        /// Hands the calling thread's partially filled batch to the aggregator thread
+        void flush() {
+            auto &slot = local_slot();
+            if (slot.batch != nullptr && slot.batch->count > 0) publish();
+        }
+
+    private:
+        struct alignas(64) Batch : MPSCQueue::Node {
+            size_t count = 0;
+            std::unique_ptr<Record[]> records;
+
+            explicit Batch(const size_t capacity) : records(new Record[capacity]) {}
+        };
+
+        /// State shared with thread-local slots, which may outlive the aggregator
+        struct Shared {
+            const size_t batch_size;
+            MPSCQueue queue;
+            std::atomic<bool> closed = false;
+
+            explicit Shared(const size_t batch_size) : batch_size(batch_size) {}
+
+            ~Shared() {
+                while (auto *node = queue.pop()) delete static_cast<Batch *>(node);
+            }
+        };
+
+        struct Slot {
+            std::shared_ptr<Shared> shared;
+            Batch *batch = nullptr;
+        };
+
+        /// Per-thread batches of all aggregators this thread recorded into
+        struct LocalSlots {
+            std::vector<Slot> slots;
+
+            ~LocalSlots() {
+                // Final drain at thread exit
+                for (auto &slot : slots) {
+                    if (slot.batch == nullptr) continue;
+                    if (slot.batch->count > 0 && !slot.shared->closed.load(std::memory_order_acquire)) {
+                        slot.shared->queue.push(slot.batch);
+                    } else {
+                        delete slot.batch;
+                    }
+                }
+            }
+        };
+
+        std::shared_ptr<Shared> shared;
+        Consumer consumer;
+        const std::chrono::microseconds poll_interval;
+        std::thread thread;
+
+        forceinline Slot &local_slot() {
+            static thread_local LocalSlots local;
+            for (auto &slot : local.slots) {
+                if (slot.shared == shared) return slot;
+            }
+            // Forget slots of destroyed aggregators
+            local.slots.erase(std::remove_if(local.slots.begin(), local.slots.end(),
+                                             [](const Slot &slot) {
+                                                 if (!slot.shared->closed.load(std::memory_order_acquire)) {
+                                                     return false;
+                                                 }
+                                                 delete slot.batch;
+                                                 return true;
+                                             }),
+                              local.slots.end());
+            return local.slots.emplace_back(Slot{shared, nullptr});
+        }
+
+        forceinline Batch *local_batch() {
+            auto &slot = local_slot();
+            if (slot.batch == nullptr) slot.batch = new Batch(shared->batch_size);
+            return slot.batch;
+        }
+
+        void publish() {
+            auto &slot = local_slot();
+            shared->queue.push(slot.batch);
+            slot.batch = nullptr;
+        }
+
+        void run() {
+            while (true) {
+                // Read closed before draining, such that the final drain sees every batch pushed before closing
+                const auto closed = shared->closed.load(std::memory_order_acquire);
+
+                bool drained_any = false;
+                while (auto *node = shared->queue.pop()) {
+                    auto *batch = static_cast<Batch *>(node);
+                    consumer(batch->records.get(), batch->count);
+                    delete batch;
+                    drained_any = true;
+                }
+
+                if (closed) return;
+                if (!drained_any) std::this_thread::sleep_for(poll_interval);
+            }
+        }
+    };
+#else
+    /**
+     * Perf::Aggregator with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Starts no thread and never invokes the consumer.
+     */
+    struct Aggregator {
+        using Consumer = std::function<void(const Record *records, size_t count)>;
+
+        explicit Aggregator(const Consumer &, const size_t = 256,
+                            const std::chrono::microseconds = std::chrono::microseconds(500)) {}
+
+        void record(const Record &) {}
+        void record(const Measurement<uint64_t> &, const std::string_view = {}) {}
+        void flush() {}
+    };
+#endif
+
+    /**
+     * Offline autotuner minimizing a counter metric over a discrete parameter
+     * space, e.g., block sizes, unroll factors and prefetch distances:
+     *
+     *   Perf::Autotuner tuner("scan");
+     *   tuner.parameter("block", {16, 32, 64}).parameter("unroll", {1, 2, 4}).minimize(Perf::cycles);
+     *   const auto best = tuner.tune([&](const auto &config) { scan(config.at("block"), config.at("unroll")); });
+     *
+     * Each configuration is measured repeatedly with a single Counter until
+     * the standard error of the metric's mean drops below a relative tolerance
+     * or the configuration is clearly worse than the best one so far. The
+     * best configuration can be persisted per machine fingerprint.
+     */
+    struct Autotuner {
+        enum Strategy { grid, random, successive_halving, bayesian };
+
+        using Configuration = std::map<std::string, int64_t>;
+        using Metric = std::function<long double(const Measurement<uint64_t> &)>;
+
+        /// A measured configuration
+        struct Trial {
+            Configuration configuration;
+            long double cost;
+            long double standard_error;
+            size_t repetitions;
+        };
+
+        /// Measurements per configuration are stopped between min_repetitions and max_repetitions
+        size_t min_repetitions = 3;
+        size_t max_repetitions = 30;
+        /// Tolerated standard error of the mean, relative to the mean
+        long double tolerance = 0.01;
+        /// Seed for random, successive halving and bayesian search
+        uint64_t seed = 42;
+
+        /**
+         * @param name name of the tuned code, used for persisting results
+         */
+        explicit Autotuner(std::string name) : name(std::move(name)) { minimize(cycles); }
+
+        /// Adds a parameter with its candidate values
+        Autotuner &parameter(const std::string &parameter_name, const std::vector<int64_t> &values) {
+            if (values.empty()) throw std::invalid_argument("Parameter without values: " + parameter_name);
+            parameters.emplace_back(parameter_name, values);
+            return *this;
+        }
+
+        /// Minimizes an event, e.g., cycles (default)
+        Autotuner &minimize(const Event event) {
+            return minimize({event}, [event](const Measurement<uint64_t> &measurement) {
+                return static_cast<long double>(measurement.data.at(event));
+            });
+        }
+
+        /**
+         * Minimizes a metric derived from the given events, e.g., cycles per
+         * instruction. All events must fit into the available perf registers
+         */
+        Autotuner &minimize(const std::vector<Event> &metric_events, Metric derived_metric) {
+            events = metric_events;
+            metric = std::move(derived_metric);
+            return *this;
+        }
+
+        /**
+         * Searches the parameter space for the configuration minimizing the metric
+         *
+         * @param fn code to tune, invoked with a Configuration
+         * @param strategy search strategy
+         * @param budget amount of configurations to measure. Grid search measures the
+         *  first budget configurations, successive halving starts with budget candidates
+         * @return best measured configuration
+         */
+        template<class F>
+        Trial tune(F &&fn, const Strategy strategy = bayesian, const size_t budget = 32) {
+            if (parameters.empty()) throw std::invalid_argument("Autotuner without parameters");
+            if (budget == 0) throw std::invalid_argument("Autotuner without budget");
+            Counter counter(events);
+            if (counter.counters_size() == 0) throw std::runtime_error("Autotuner requires perf counters");
+            std::mt19937_64 rng(seed);
+            const auto candidates = std::min(budget, space_size());
+            history.clear();
+
+            const auto measure = [&](const size_t index, const size_t repetitions, const long double best) {
+                history.push_back(evaluate(counter, fn, configuration(index), repetitions, best));
+                return history.back();
+            };
+
+            switch (strategy) {
+                case grid:
+                    for (size_t index = 0; index < candidates; index++) measure(index, max_repetitions, best_cost());
+                    break;
+                case random:
+                    for (const auto index : sample(candidates, rng)) measure(index, max_repetitions, best_cost());
+                    break;
+                case successive_halving: {
+                    // Halve the candidates each round, doubling the repetitions spent on survivors
+                    auto survivors = sample(candidates, rng);
+                    auto repetitions = min_repetitions;
+                    while (true) {
+                        std::vector<std::pair<long double, size_t>> round;
+                        for (const auto index : survivors) {
+                            const auto inf = std::numeric_limits<long double>::infinity();
+                            round.emplace_back(measure(index, repetitions, inf).cost, index);
+                        }
+                        if (survivors.size() <= 1) return history.back();
+
+                        std::sort(round.begin(), round.end());
+                        survivors.clear();
+                        for (size_t i = 0; i < (round.size() + 1) / 2; i++) survivors.push_back(round[i].second);
+                        repetitions = std::min(max_repetitions, 2 * repetitions);
+                    }
+                }
+                case bayesian: {
+                    const auto initial = std::max<size_t>(2, candidates / 4);
+                    std::vector<size_t> measured;
+                    for (const auto index : sample(std::min(initial, candidates), rng)) {
+                        measure(index, max_repetitions, best_cost());
+                        measured.push_back(index);
+                    }
+                    while (measured.size() < candidates) {
+                        const auto index = expected_improvement_maximum(measured, rng);
+                        measure(index, max_repetitions, best_cost());
+                        measured.push_back(index);
+                    }
+                    break;
+                }
+            }
+
+            return *std::min_element(history.begin(), history.end(),
+                                     [](const Trial &a, const Trial &b) { return a.cost < b.cost; });
+        }
+
+        /// All trials of the last tune() invocation, in measurement order
+        const std::vector<Trial> &trials() const { return history; }
+
+        /**
+         * Pretty print one row per trial of the last tune() invocation
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            for (const auto &parameter : parameters) std::cout << std::setw(column_width) << parameter.first;
+            std::cout << std::setw(column_width) << "Cost" << std::setw(column_width) << "Std. error"
+                      << std::setw(column_width) << "Repetitions" << std::endl;
+            for (const auto &trial : history) {
+                for (const auto &[parameter_name, values] : parameters) {
+                    std::cout << std::setw(column_width) << trial.configuration.at(parameter_name);
+                }
+                std::cout << std::setw(column_width) << std::to_string(trial.cost) << std::setw(column_width)
+                          << std::to_string(trial.standard_error) << std::setw(column_width) << trial.repetitions
+                          << std::endl;
+            }
+        }
+
+        /// Identifies the current machine by CPU model, logical core count and memory size
+        static std::string machine_fingerprint() {
+            char brand[256] = {};
+            size_t size = sizeof(brand) - 1;
+            if (sysctlbyname("machdep.cpu.brand_string", brand, &size, nullptr, 0)) brand[0] = '\0';
+
+            const auto number = [](const char *sysctl_name) {
+                uint64_t value = 0;
+                size_t value_size = sizeof(value);
+                if (sysctlbyname(sysctl_name, &value, &value_size, nullptr, 0)) return uint64_t(0);
+                return value;
+            };
+            return std::string(brand) + "/" + std::to_string(number("hw.logicalcpu")) + "/" +
+                   std::to_string(number("hw.memsize"));
+        }
+
+        /**
+         * Appends a configuration, e.g., the result of tune(), to a tuning file
+         * for this tuner and the current machine fingerprint
+         */
+        void persist(const Trial &trial, const std::string &path) const {
+            std::ofstream file(path, std::ios::app);
+            file << machine_fingerprint() << '\t' << name << '\t' << std::to_string(trial.cost) << '\t';
+            for (const auto &[parameter_name, value] : trial.configuration) {
+                file << parameter_name << '=' << value << ';';
+            }
+            file << std::endl;
+            if (!file) throw std::runtime_error("Could not persist tuning result to " + path);
+        }
+
+        /// Most recently persisted configuration of this tuner for the current machine, if any
+        std::optional<Configuration> recall(const std::string &path) const {
+            std::ifstream file(path);
+            const auto fingerprint = machine_fingerprint();
+            std::optional<Configuration> result;
+
+            std::string line;
+            while (std::getline(file, line)) {
+                std::vector<std::string> fields;
+                size_t begin = 0;
+                for (size_t end; (end = line.find('\t', begin)) != std::string::npos; begin = end + 1) {
+                    fields.push_back(line.substr(begin, end - begin));
+                }
+                fields.push_back(line.substr(begin));
+                if (fields.size() != 4 || fields[0] != fingerprint || fields[1] != name) continue;
+
+                Configuration configuration;
+                begin = 0;
+                for (size_t end; (end = fields[3].find(';', begin)) != std::string::npos; begin = end + 1) {
+                    const auto assignment = fields[3].substr(begin, end - begin);
+                    const auto separator = assignment.find('=');
+                    configuration[assignment.substr(0, separator)] = std::stoll(assignment.substr(separator + 1));
+                }
+                result = configuration;
+            }
+            return result;
+        }
+
+    private:
+        std::string name;
+        std::vector<std::pair<std::string, std::vector<int64_t>>> parameters;
+        std::vector<Event> events;
+        Metric metric;
+        std::vector<Trial> history;
+
+        size_t space_size() const {
+            size_t size = 1;
+            for (const auto &[parameter_name, values] : parameters) size *= values.size();
+            return size;
+        }
+
+        /// Value indices of a configuration, i.e., its mixed radix digits
+        std::vector<size_t> digits(size_t index) const {
+            std::vector<size_t> result;
+            for (const auto &[parameter_name, values] : parameters) {
+                result.push_back(index % values.size());
+                index /= values.size();
+            }
+            return result;
+        }
+
+        Configuration configuration(const size_t index) const {
+            Configuration result;
+            const auto value_indices = digits(index);
+            for (size_t i = 0; i < parameters.size(); i++) {
+                result[parameters[i].first] = parameters[i].second[value_indices[i]];
+            }
+            return result;
+        }
+
+        long double best_cost() const {
+            long double best = std::numeric_limits<long double>::infinity();
+            for (const auto &trial : history) best = std::min(best, trial.cost);
+            return best;
+        }
+
+        /// Distinct random configuration indices
+        std::vector<size_t> sample(const size_t count, std::mt19937_64 &rng) const {
+            std::vector<size_t> indices;
+            std::unordered_map<size_t, bool> taken;
+            std::uniform_int_distribution<size_t> distribution(0, space_size() - 1);
+            while (indices.size() < count) {
+                const auto index = distribution(rng);
+                if (taken.emplace(index, true).second) indices.push_back(index);
+            }
+            return indices;
+        }
+
+        /**
+         * Measures a configuration until the mean is precise enough, it is
+         * clearly (two standard errors) worse than best, or repetitions are exhausted
+         */
+        template<class F>
+        Trial evaluate(Counter &counter, F &fn, const Configuration &configuration, const size_t repetitions,
+                       const long double best) const {
+            // Warm up caches and branch predictors
+            fn(configuration);
+
+            long double sum = 0, squares = 0, mean = 0, standard_error = 0;
+            size_t n = 0;
+            while (n < std::max<size_t>(repetitions, 1)) {
+                counter.start();
+                fn(configuration);
+                const auto sample = metric(counter.stop());
+                sum += sample;
+                squares += sample * sample;
+                n++;
+
+                mean = sum / n;
+                if (n < 2) continue;
+                const auto variance = std::max(0.0L, (squares - n * mean * mean) / (n - 1));
+                standard_error = std::sqrt(variance / n);
+                if (n < min_repetitions) continue;
+                if (standard_error <= tolerance * std::abs(mean) || mean - 2 * standard_error > best) break;
+            }
+            return {configuration, mean, standard_error, n};
+        }
+
+        /**
+         * Bayesian optimization step: fits a Gaussian process (squared exponential
+         * kernel over value indices normalized to [0, 1]) to the measured costs and
+         * returns the unmeasured configuration with maximum expected improvement
+         */
+        size_t expected_improvement_maximum(const std::vector<size_t> &measured, std::mt19937_64 &rng) const {
+            const auto n = measured.size();
+            const auto point = [&](const size_t index) {
+                const auto value_indices = digits(index);
+                std::vector<long double> x(parameters.size());
+                for (size_t i = 0; i < parameters.size(); i++) {
+                    const auto values = parameters[i].second.size();
+                    x[i] = values == 1 ? 0 : static_cast<long double>(value_indices[i]) / (values - 1);
+                }
+                return x;
+            };
+            const auto kernel = [](const std::vector<long double> &a, const std::vector<long double> &b) {
+                constexpr long double length_scale = 0.25;
+                long double distance = 0;
+                for (size_t i = 0; i < a.size(); i++) distance += (a[i] - b[i]) * (a[i] - b[i]);
+                return std::exp(-distance / (2 * length_scale * length_scale));
+            };
+
+            // Standardized costs
+            std::vector<std::vector<long double>> xs;
+            std::vector<long double> ys;
+            long double mean = 0, deviation = 0;
+            for (size_t i = 0; i < n; i++) {
+                xs.push_back(point(measured[i]));
+                ys.push_back(history[history.size() - n + i].cost);
+                mean += ys.back() / n;
+            }
+            for (const auto y : ys) deviation += (y - mean) * (y - mean) / n;
+            deviation = deviation > 0 ? std::sqrt(deviation) : 1;
+            for (auto &y : ys) y = (y - mean) / deviation;
+
+            // Cholesky decomposition of the kernel matrix with observation noise
+            constexpr long double noise = 1e-2;
+            std::vector<long double> l(n * n, 0);
+            for (size_t i = 0; i < n; i++) {
+                for (size_t j = 0; j <= i; j++) {
+                    long double sum = kernel(xs[i], xs[j]) + (i == j ? noise : 0);
+                    for (size_t k = 0; k < j; k++) sum -= l[i * n + k] * l[j * n + k];
+                    l[i * n + j] = i == j ? std::sqrt(std::max(sum, 1e-12L)) : sum / l[j * n + j];
+                }
+            }
+            const auto solve_lower = [&](std::vector<long double> b) {
+                for (size_t i = 0; i < n; i++) {
+                    for (size_t k = 0; k < i; k++) b[i] -= l[i * n + k] * b[k];
+                    b[i] /= l[i * n + i];
+                }
+                return b;
+            };
+            // alpha = K^-1 y via forward and backward substitution
+            auto alpha = solve_lower(ys);
+            for (size_t i = n; i-- > 0;) {
+                for (size_t k = i + 1; k < n; k++) alpha[i] -= l[k * n + i] * alpha[k];
+                alpha[i] /= l[i * n + i];
+            }
+
+            // Candidates: all unmeasured configurations, or a random subset for large spaces
+            std::unordered_map<size_t, bool> taken;
+            for (const auto index : measured) taken.emplace(index, true);
+            std::vector<size_t> candidates;
+            if (space_size() <= 4096) {
+                for (size_t index = 0; index < space_size(); index++) {
+                    if (!taken.count(index)) candidates.push_back(index);
+                }
+            } else {
+                std::uniform_int_distribution<size_t> distribution(0, space_size() - 1);
+                while (candidates.size() < 1024) {
+                    const auto index = distribution(rng);
+                    if (!taken.count(index)) candidates.push_back(index);
+                }
+            }
+
+            const auto best = *std::min_element(ys.begin(), ys.end());
+            size_t argmax = candidates.front();
+            long double max = -1;
+            for (const auto index : candidates) {
+                const auto x = point(index);
+                std::vector<long double> k(n);
+                for (size_t i = 0; i < n; i++) k[i] = kernel(x, xs[i]);
+
+                long double mu = 0;
+                for (size_t i = 0; i < n; i++) mu += k[i] * alpha[i];
+                const auto v = solve_lower(k);
+                long double variance = 1;
+                for (const auto vi : v) variance -= vi * vi;
+                const auto sigma = std::sqrt(std::max(variance, 1e-12L));
+
+                const auto z = (best - mu) / sigma;
+                const auto cdf = 0.5L * std::erfc(-z / std::sqrt(2.0L));
+                const auto pdf = std::exp(-z * z / 2) / std::sqrt(2 * M_PI);
+                const auto improvement = (best - mu) * cdf + sigma * pdf;
+                if (improvement > max) {
+                    max = improvement;
+                    argmax = index;
+                }
+            }
+            return argmax;
+        }
+    };
+
+#ifndef PERF_MACOS_DISABLE
+    /**
+     * Online selection among implementations of the same operation, e.g.,
+     * hash join or sort variants, as a multi-armed bandit over their cost in
+     * cycles per item:
+     *
+     *   Perf::Selector<size_t(const Input &)> join;
+     *   join.add("radix", radix_join).add("chained", chained_join);
+     *   const auto matches = join(input.size(), input);
+     *
+     * Only every sample_period-th call is measured, bracketed by two raw
+     * counter reads (see Counter::read()). Registers are programmed once on
+     * construction, i.e., the selector owns the perf registers of its thread
+     * while in use: starting any other Counter on that thread reprograms them
+     * and skews subsequent samples. All other calls go to the current winner.
+     * Exploration of other implementations is bounded to a fraction of the
+     * measured calls. Costs are exponential moving averages, so they follow
+     * drifting inputs. A sustained shift of the winner's cost triggers a
+     * re-measurement of all implementations. Not thread safe, i.e., use one
+     * selector per thread.
+     */
+    template<class Signature>
+    struct Selector;
+
+    template<class R, class... Args>
+    struct Selector<R(Args...)> {
+        using Implementation = std::function<R(Args...)>;
+
+        /// Every sample_period-th call is measured
+        const size_t sample_period;
+        /// Maximum fraction of measured calls routed to implementations other than the winner
+        double exploration = 0.1;
+        /// Weight of a new sample in an implementation's moving average cost
+        double smoothing = 0.2;
+        /// Relative deviation of the winner's samples from its average cost considered drift
+        double drift_threshold = 0.5;
+        /// Consecutive drifting samples of the winner after which all implementations are re-measured
+        size_t drift_samples = 3;
+
+        /**
+         * @param sample_period every sample_period-th call is measured, at least 1
+         */
+        explicit Selector(const size_t sample_period = 16)
+            : sample_period(std::max<size_t>(1, sample_period)), counter(std::vector<Event>{cycles}) {
+            from.resize(std::max<size_t>(counter.counters_size(), 1), 0);
+            to.resize(from.size(), 0);
+            counter.configure();
+        }
+
+        /// Registers an implementation
+        Selector &add(const std::string &name, Implementation implementation) {
+            arms.push_back({name, std::move(implementation)});
+            return *this;
+        }
+
+        /**
+         * Invokes the selected implementation
+         *
+         * @param items amount of items processed by this call, e.g., input size
+         * @param args arguments passed on to the implementation
+         */
+        R operator()(const size_t items, Args... args) {
+            if (arms.empty()) throw std::logic_error("Perf::Selector without implementations");
+            if (++calls % sample_period != 0) return arms[winner].implementation(std::forward<Args>(args)...);
+
+            const auto arm = choose();
+            counter.read(from.data());
+            if constexpr (std::is_void_v<R>) {
+                arms[arm].implementation(std::forward<Args>(args)...);
+                counter.read(to.data());
+                update(arm, items);
+            } else {
+                R result = arms[arm].implementation(std::forward<Args>(args)...);
+                counter.read(to.data());
+                update(arm, items);
+                return result;
+            }
+        }
+
+        /// Name of the implementation most calls are currently routed to
+        const std::string &selected() const { return arms.at(winner).name; }
+
+        /**
+         * Pretty print the cost estimate of each implementation
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            std::cout << std::setw(column_width) << "Implementation" << std::setw(column_width) << "Cycles/item"
+                      << std::setw(column_width) << "Samples" << std::setw(column_width) << "Selected" << std::endl;
+            for (size_t i = 0; i < arms.size(); i++) {
+                std::cout << std::setw(column_width) << arms[i].name << std::setw(column_width)
+                          << std::to_string(arms[i].cost) << std::setw(column_width) << arms[i].samples
+                          << std::setw(column_width) << (i == winner ? "*" : "") << std::endl;
+            }
+        }
+
+    private:
+        struct Arm {
+            std::string name;
+            Implementation implementation;
+            long double cost = 0;
+            uint64_t samples = 0;
+            uint64_t last_sampled = 0;
+            bool stale = false;
+        };
+
+        Counter counter;
+        std::vector<uint64_t> from, to;
+        std::vector<Arm> arms;
+        size_t winner = 0;
+        uint64_t calls = 0, measured = 0, explored = 0;
+        size_t drifting = 0;
+
+        size_t choose() {
+            measured++;
+
+            // Implementations without (current) estimate first
+            for (size_t i = 0; i < arms.size(); i++) {
+                if (arms[i].samples == 0 || arms[i].stale) return i;
+            }
+
+            // Bounded exploration of the least recently measured other implementation
+            if (arms.size() > 1 && explored < exploration * measured) {
+                size_t oldest = winner == 0 ? 1 : 0;
+                for (size_t i = 0; i < arms.size(); i++) {
+                    if (i != winner && arms[i].last_sampled < arms[oldest].last_sampled) oldest = i;
+                }
+                explored++;
+                return oldest;
+            }
+            return winner;
+        }
+
+        void update(const size_t arm, const size_t items) {
+            const auto cost = static_cast<long double>(to[0] - from[0]) / std::max<size_t>(items, 1);
+            auto &estimate = arms[arm];
+
+            if (arm == winner && estimate.samples > 0 && !estimate.stale) {
+                drifting = std::abs(cost - estimate.cost) > drift_threshold * estimate.cost ? drifting + 1 : 0;
+                if (drifting >= drift_samples) {
+                    for (auto &other : arms) other.stale = true;
+                    drifting = 0;
+                }
+            }
+
+            const auto fresh = estimate.samples == 0 || estimate.stale;
+            estimate.cost = fresh ? cost : estimate.cost + smoothing * (cost - estimate.cost);
+            estimate.samples++;
+            estimate.last_sampled = measured;
+            estimate.stale = false;
+
+            for (size_t i = 0; i < arms.size(); i++) {
+                if (arms[i].samples > 0 && (arms[winner].samples == 0 || arms[i].cost < arms[winner].cost)) winner = i;
+            }
+        }
+    };
+#else
+    /**
+     * Perf::Selector with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Measures nothing and routes every call to the first implementation.
+     */
+    template<class Signature>
+    struct Selector;
+
+    template<class R, class... Args>
+    struct Selector<R(Args...)> {
+        using Implementation = std::function<R(Args...)>;
+
+        const size_t sample_period;
+        double exploration = 0.1;
+        double smoothing = 0.2;
+        double drift_threshold = 0.5;
+        size_t drift_samples = 3;
+
+        explicit Selector(const size_t sample_period = 16) : sample_period(std::max<size_t>(1, sample_period)) {}
+
+        Selector &add(const std::string &name, Implementation implementation) {
+            arms.emplace_back(name, std::move(implementation));
+            return *this;
+        }
+
+        R operator()(const size_t, Args... args) {
+            if (arms.empty()) throw std::logic_error("Perf::Selector without implementations");
+            return arms.front().second(std::forward<Args>(args)...);
+        }
+
+        const std::string &selected() const { return arms.at(0).first; }
+        void pretty_print(unsigned int = 15) const {}
+
+    private:
+        std::vector<std::pair<std::string, Implementation>> arms;
+    };
+#endif
+
+#ifndef PERF_MACOS_DISABLE
+    /**
+     * Captures diagnostics of slow executions of a region, e.g., calls that
+     * occasionally exceed their cycle or latency budget in production. Calls
+     * exceeding a threshold on an event or on elapsed time record their full
+     * measurement, a stack trace, the process' software events (page faults,
+     * context switches, block I/O) and a timestamp into a bounded ring.
+     *
+     * Calls below the threshold only cost two raw counter reads (see
+     * Counter::read()), two clock reads and a predictable branch. Registers
+     * are programmed once on construction, i.e., the capture owns the perf
+     * registers of its thread while in use: starting any other Counter on
+     * that thread reprograms them and skews subsequent captures. Software
+     * events are process totals at capture time, i.e., compare them across
+     * captures. Not thread safe, i.e., use one instance per thread.
+     */
+    struct ThresholdCapture {
+        /// Diagnostics of a single slow execution
+        struct Capture {
+            Measurement<uint64_t> measurement;
+            std::vector<void *> stack;
+            rusage software_events;
+            std::chrono::system_clock::time_point timestamp;
+
+            /// Symbolized stack trace, innermost frame first
+            std::vector<std::string> symbolized_stack() const {
+                std::vector<std::string> frames;
+                char **symbols = backtrace_symbols(stack.data(), static_cast<int>(stack.size()));
+                if (symbols == nullptr) return frames;
+                for (size_t i = 0; i < stack.size(); i++) frames.emplace_back(symbols[i]);
+                free(symbols);
+                return frames;
+            }
+        };
+
+        /**
+         * Captures executions in which threshold_event exceeds threshold
+         *
+         * @param threshold_event event compared against threshold, always measured in the first register
+         * @param threshold maximum amount of threshold_event within budget
+         * @param events events recorded in captured measurements
+         * @param capacity maximum amount of retained captures, older ones are dropped
+         */
+        ThresholdCapture(const Event threshold_event, const uint64_t threshold,
+                         const std::vector<Event> &events = {cycles, instructions_retired, l1_misses, llc_misses},
+                         const size_t capacity = 64)
+            : counter(first(events, threshold_event)), threshold(threshold), capacity(capacity) {
+            from.resize(std::max<size_t>(counter.counters_size(), 1), 0);
+            to.resize(from.size(), 0);
+            counter.configure();
+        }
+
+        /**
+         * Captures executions whose elapsed time exceeds threshold
+         *
+         * @param threshold latency budget
+         * @param events events recorded in captured measurements
+         * @param capacity maximum amount of retained captures, older ones are dropped
+         */
+        ThresholdCapture(const std::chrono::nanoseconds threshold,
+                         const std::vector<Event> &events = {cycles, instructions_retired, l1_misses, llc_misses},
+                         const size_t capacity = 64)
+            : counter(events), threshold(threshold.count()), capacity(capacity), threshold_time(true) {
+            from.resize(std::max<size_t>(counter.counters_size(), 1), 0);
+            to.resize(from.size(), 0);
+            counter.configure();
+        }
+
+        forceinline void start() {
+            start_time = std::chrono::steady_clock::now();
+            counter.read(from.data());
+        }
+
+        forceinline void stop() {
+            counter.read(to.data());
+            const auto end_time = std::chrono::steady_clock::now();
+
+            const auto elapsed_ns = static_cast<uint64_t>((end_time - start_time).count());
+            const auto value = threshold_time ? elapsed_ns : to[0] - from[0];
+            if (__builtin_expect(value > threshold, 0)) capture(elapsed_ns);
+        }
+
+        /// Retained captures, oldest first
+        const std::deque<Capture> &captures() const { return ring; }
+
+        /// Amount of captures dropped because the ring was full
+        uint64_t dropped() const { return dropped_captures; }
+
+        /**
+         * Pretty print all retained captures, oldest first
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            for (const auto &capture : ring) {
+                const auto timestamp = std::chrono::system_clock::to_time_t(capture.timestamp);
+                char time[64];
+                strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", localtime(&timestamp));
+                std::cout << "[Perf::ThresholdCapture] " << time << std::endl;
+
+                capture.measurement.pretty_print(column_width);
+                const auto &events = capture.software_events;
+                std::cout << "Minor faults: " << events.ru_minflt << ", major faults: " << events.ru_majflt
+                          << ", voluntary switches: " << events.ru_nvcsw << ", involuntary switches: "
+                          << events.ru_nivcsw << ", block in: " << events.ru_inblock
+                          << ", block out: " << events.ru_oublock << std::endl;
+                for (const auto &frame : capture.symbolized_stack()) std::cout << "  " << frame << std::endl;
+            }
+            if (dropped_captures > 0) std::cout << "Dropped captures: " << dropped_captures << std::endl;
+        }
+
+    private:
+        Counter counter;
+        std::vector<uint64_t> from, to;
+        std::chrono::steady_clock::time_point start_time;
+        const uint64_t threshold;
+        const size_t capacity;
+        const bool threshold_time = false;
+        std::deque<Capture> ring;
+        uint64_t dropped_captures = 0;
+
+        static std::vector<Event> first(std::vector<Event> events, const Event event) {
+            events.erase(std::remove(events.begin(), events.end(), event), events.end());
+            events.insert(events.begin(), event);
+            return events;
+        }
+
+        __attribute__((noinline, cold)) void capture(const uint64_t elapsed_ns) {
+            constexpr int max_frames = 64;
+            void *frames[max_frames];
+            const auto depth = backtrace(frames, max_frames);
+
+            rusage software_events{};
+            getrusage(RUSAGE_SELF, &software_events);
+
+            if (capacity == 0) return;
+            if (ring.size() == capacity) {
+                ring.pop_front();
+                dropped_captures++;
+            }
+            ring.push_back({counter.delta(from.data(), to.data(), elapsed_ns),
+                            std::vector<void *>(frames, frames + std::max(depth, 0)), software_events,
+                            std::chrono::system_clock::now()});
+        }
+    };
+#else
+    /**
+     * Perf::ThresholdCapture with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Reads neither counters nor clocks and never captures.
+     */
+    struct ThresholdCapture {
+        struct Capture {
+            Measurement<uint64_t> measurement;
+            std::vector<void *> stack;
+            rusage software_events;
+            std::chrono::system_clock::time_point timestamp;
+
+            std::vector<std::string> symbolized_stack() const { return {}; }
+        };
+
+        ThresholdCapture(const Event, const uint64_t, std::initializer_list<Event> = {}, const size_t = 64) {}
+        ThresholdCapture(const Event, const uint64_t, const std::vector<Event> &, const size_t = 64) {}
+        ThresholdCapture(const std::chrono::nanoseconds, std::initializer_list<Event> = {}, const size_t = 64) {}
+        ThresholdCapture(const std::chrono::nanoseconds, const std::vector<Event> &, const size_t = 64) {}
+
+        void start() {}
+        void stop() {}
+
+        const std::deque<Capture> &captures() const {
+            static const std::deque<Capture> none;
+            return none;
+        }
+        uint64_t dropped() const { return 0; }
+        void pretty_print(unsigned int = 15) const {}
+    };
+#endif
+
+    /**
+     * Named instrumentation region that can be switched on and off at runtime,
+     * e.g., to measure a specific region of a running process without restart:
+     *
+     *   static Perf::Region lookup("lookup");
+     *   Perf::RegionCounter counter(lookup);
+     *   counter.start(); ... counter.stop();
+     *
+     * Each region checks a single relaxed atomic flag, i.e., a disabled region
+     * costs one predictable branch and skips all counter reads. Flags live in
+     * a fixed slot registry, which other processes may control via shared
+     * memory (see share() and set_shared()), or which is updated from a
+     * control file on a signal (see watch()).
+     */
+    struct Region {
+        static constexpr size_t max_regions = 256;
+        static constexpr size_t max_name_length = 47;
+
+        /// Registry of all regions. Page aligned, i.e., share() can map shared memory over it in place
+        struct alignas(4096) ControlBlock {
+            std::atomic<uint32_t> count;
+            char names[max_regions][max_name_length + 1];
+            std::atomic<uint8_t> enabled[max_regions];
+        };
+
+        /**
+         * Registers a region. Regions of the same name share their flag
+         *
+         * @param name name of the region, at most max_name_length chars
+         * @param enabled initial state, unless the name was already registered, e.g., via set()
+         */
+        explicit Region(const std::string &name, const bool enabled = true) : flag(slot(name, enabled)) {}
+
+        forceinline bool enabled() const { return flag.load(std::memory_order_relaxed); }
+
+        /// Enables or disables a region by name. Unknown names are registered, i.e., may be set before construction
+        static void set(const std::string &name, const bool enabled) {
+            slot(name, enabled).store(enabled, std::memory_order_relaxed);
+        }
+
+        /// Enables or disables all registered regions
+        static void set_all(const bool enabled) {
+            const auto count = block.count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; i++) block.enabled[i].store(enabled, std::memory_order_relaxed);
+        }
+
+        /**
+         * Moves the registry of this process into POSIX shared memory, e.g.,
+         * for a controlling process using set_shared()
+         *
+         * @param shm_name shared memory object name, defaults to "/perf-macos.<pid>"
+         * @return shared memory object name
+         */
+        static std::string share(std::string shm_name = "") {
+            if (shm_name.empty()) shm_name = "/perf-macos." + std::to_string(getpid());
+            std::lock_guard<std::mutex> lock(registry_mutex);
+
+            auto *shared = map_shared(shm_name, true);
+            std::memcpy(static_cast<void *>(shared), static_cast<const void *>(&block), sizeof(ControlBlock));
+            munmap(shared, sizeof(ControlBlock));
+
+            // Replace the registry's pages with the shared ones, i.e., all region flags stay valid
+            const auto fd = shm_open(shm_name.c_str(), O_RDWR, 0600);
+            if (fd < 0) throw std::runtime_error("Could not open shared memory " + shm_name);
+            const auto mapped =
+                    mmap(&block, sizeof(ControlBlock), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) throw std::runtime_error("Could not map shared memory " + shm_name);
+            return shm_name;
+        }
+
+        /**
+         * Enables or disables a region of another process, see share()
+         *
+         * @return whether the region is registered in that process
+         */
+        static bool set_shared(const std::string &shm_name, const std::string &name, const bool enabled) {
+            auto *shared = map_shared(shm_name, false);
+            bool found = false;
+            const auto count = std::min<size_t>(shared->count.load(std::memory_order_acquire), max_regions);
+            for (size_t i = 0; i < count; i++) {
+                if (name == shared->names[i]) {
+                    shared->enabled[i].store(enabled, std::memory_order_relaxed);
+                    found = true;
+                }
+            }
+            munmap(shared, sizeof(ControlBlock));
+            return found;
+        }
+
+        /**
+         * Applies a control file whenever this process receives a signal. Each
+         * line of the file is either "<region>=<0|1>" or "*=<0|1>" for all
+         * regions. Unregistered region names are ignored.
+         *
+         * @param path control file
+         * @param signal signal to watch, defaults to SIGUSR1
+         */
+        static void watch(const std::string &path, const int signal = SIGUSR1) {
+            if (path.size() >= sizeof(control_path)) throw std::invalid_argument("Control file path too long");
+            std::memcpy(control_path, path.c_str(), path.size() + 1);
+
+            struct sigaction action {};
+            action.sa_handler = on_signal;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if (sigaction(signal, &action, nullptr)) throw std::runtime_error("Could not install signal handler");
+        }
+
+    private:
+        const std::atomic<uint8_t> &flag;
+
+        static inline ControlBlock block{};
+        static inline std::mutex registry_mutex;
+        static inline char control_path[1024] = {};
+
+        static std::atomic<uint8_t> &slot(const std::string &name, const bool enabled) {
+            if (name.empty() || name.size() > max_name_length) throw std::invalid_argument("Invalid region: " + name);
+            std::lock_guard<std::mutex> lock(registry_mutex);
+
+            const auto count = block.count.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < count; i++) {
+                if (name == block.names[i]) return block.enabled[i];
+            }
+            if (count == max_regions) throw std::runtime_error("Too many Perf::Region instances");
+
+            std::memcpy(block.names[count], name.c_str(), name.size() + 1);
+            block.enabled[count].store(enabled, std::memory_order_relaxed);
+            block.count.store(count + 1, std::memory_order_release);
+            return block.enabled[count];
+        }
+
+        static ControlBlock *map_shared(const std::string &shm_name, const bool create) {
+            const auto fd = shm_open(shm_name.c_str(), O_RDWR | (create ? O_CREAT : 0), 0600);
+            if (fd < 0) throw std::runtime_error("Could not open shared memory " + shm_name);
+
+            // Shared memory objects may only be sized once on macOS
+            struct stat status {};
+            if (fstat(fd, &status) || (static_cast<size_t>(status.st_size) < sizeof(ControlBlock) &&
+                                       ftruncate(fd, sizeof(ControlBlock)))) {
+                close(fd);
+                throw std::runtime_error("Could not size shared memory " + shm_name);
+            }
+
+            const auto mapped = mmap(nullptr, sizeof(ControlBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) throw std::runtime_error("Could not map shared memory " + shm_name);
+            return static_cast<ControlBlock *>(mapped);
+        }
+
+        /// Async signal safe, i.e., only uses open(), read() and close() without allocating
+        static void on_signal(int) {
+            const auto saved_errno = errno;
+            const auto fd = open(control_path, O_RDONLY);
+            if (fd < 0) {
+                errno = saved_errno;
+                return;
+            }
+            char buffer[8192];
+            const auto size = read(fd, buffer, sizeof(buffer));
+            close(fd);
+
+            const auto count = block.count.load(std::memory_order_acquire);
+            for (ssize_t begin = 0; begin < size;) {
+                ssize_t end = begin;
+                while (end < size && buffer[end] != '\n') end++;
+
+                ssize_t separator = begin;
+                while (separator < end && buffer[separator] != '=') separator++;
+                if (separator + 1 < end) {
+                    const auto length = static_cast<size_t>(separator - begin);
+                    const bool enabled = buffer[separator + 1] == '1';
+                    const bool all = length == 1 && buffer[begin] == '*';
+                    for (size_t i = 0; i < count; i++) {
+                        if (all || (strnlen(block.names[i], max_name_length + 1) == length &&
+                                    std::memcmp(block.names[i], buffer + begin, length) == 0)) {
+                            block.enabled[i].store(enabled, std::memory_order_relaxed);
+                        }
+                    }
+                }
+                begin = end + 1;
+            }
+            errno = saved_errno;
+        }
+    };
+
+#ifndef PERF_MACOS_DISABLE
+    /**
+     * Perf::Counter of a Perf::Region, i.e., start() and stop() skip all
+     * counter reads while the region is disabled
+     */
+    struct RegionCounter : public Counter {
+        /**
+         * @param region region this counter measures
+         * @param measured_events
+         */
+        explicit RegionCounter(const Region &region,
+                               std::vector<Event> measured_events = {instructions_retired, l1_misses, llc_misses,
+                                                                     branch_misses_retired, cycles,
+                                                                     branch_instruction_retired})
+            : Counter(measured_events), region(region) {}
+
+        forceinline void start() {
+            active = region.enabled();
+            if (active) Counter::start();
+        }
+
+        /**
+         * @return measurement since start(), empty if the region was disabled at start()
+         */
+        forceinline Measurement<uint64_t> stop() {
+            if (!active) return {};
+            active = false;
+            return Counter::stop();
+        }
+
+    private:
+        const Region &region;
+        bool active = false;
+    };
+#else
+    /**
+     * Perf::RegionCounter with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Does not even check whether the region is enabled.
+     */
+    struct RegionCounter : public Counter {
+        explicit RegionCounter(const Region &, std::initializer_list<Event> = {}) {}
+        RegionCounter(const Region &, const std::vector<Event> &) {}
+    };
+#endif
+
+#ifndef PERF_MACOS_DISABLE
+    /**
+     * Asynchronous measurement output. Measured threads push Records into a
+     * bounded lock free queue (D. Vyukov, "Bounded MPMC queue"), and a
+     * background thread formats them with std::to_chars and writes them in
+     * batches, i.e., neither formatting nor I/O happens on the instrumented
+     * path. Each record is written as one line:
+     *
+     *   <label> time_ns=<elapsed> <identifier>=<value>...
+     *
+     * Remaining records are written when the writer is destroyed.
+     */
+    struct AsyncWriter {
+        /// Behaviour of push() when the queue is full (drop, block) or filling up (sample)
+        enum Backpressure { drop, block, sample };
+
+        /**
+         * Writes to a file descriptor, e.g., STDOUT_FILENO (default)
+         *
+         * @param fd file descriptor, not closed by the writer
+         * @param backpressure behaviour under backpressure
+         * @param capacity queue capacity in records, rounded up to the next power of two
+         * @param sample_period sample only keeps every sample_period-th record while the queue is over half full
+         * @param poll_interval time the writer thread sleeps when the queue is empty
+         */
+        explicit AsyncWriter(const int fd = STDOUT_FILENO, const Backpressure backpressure = drop,
+                             const size_t capacity = 4096, const size_t sample_period = 8,
+                             const std::chrono::microseconds poll_interval = std::chrono::microseconds(500))
+            : fd(fd), backpressure(backpressure), sample_period(std::max<size_t>(1, sample_period)),
+              poll_interval(poll_interval), mask(round_up_power_of_two(capacity) - 1), cells(new Cell[mask + 1]) {
+            for (size_t i = 0; i <= mask; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+            thread = std::thread([this] { run(); });
+        }
+
+        /// Appends to a file, which is created if necessary
+        explicit AsyncWriter(const std::string &path, const Backpressure backpressure = drop,
+                             const size_t capacity = 4096, const size_t sample_period = 8)
+            : AsyncWriter(open_file(path), backpressure, capacity, sample_period) {
+            owns_fd = true;
+        }
+
+        /// Writes all queued records and stops the writer thread
+        ~AsyncWriter() {
+            closed.store(true, std::memory_order_release);
+            thread.join();
+            if (owns_fd) close(fd);
+        }
+
+        AsyncWriter(const AsyncWriter &) = delete;
+        AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+        /**
+         * Queues a record for writing. Lock free unless backpressure is block
+         * and the queue is full
+         *
+         * @return whether the record was queued, i.e., not dropped or sampled out
+         */
+        forceinline bool push(const Record &record) {
+            if (backpressure == sample && size() > (mask + 1) / 2 &&
+                skipped.fetch_add(1, std::memory_order_relaxed) % sample_period != 0) {
+                dropped_records.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            while (!try_push(record)) {
+                if (backpressure != block) {
+                    dropped_records.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+            return true;
+        }
+
+        /// Convenience wrapper, see Record::from()
+        bool push(const Measurement<uint64_t> &measurement, const std::string_view label = {}) {
+            return push(Record::from(measurement, label));
+        }
+
+        /// Blocks until all records queued before this call are written
+        void flush() const {
+            const auto target = enqueue_position.load(std::memory_order_acquire);
+            while (written.load(std::memory_order_acquire) < target) std::this_thread::sleep_for(poll_interval);
+        }
+
+        /// Amount of records dropped or sampled out so far
+        uint64_t dropped() const { return dropped_records.load(std::memory_order_relaxed); }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            Record record;
+        };
+
+        const int fd;
+        bool owns_fd = false;
+        const Backpressure backpressure;
+        const size_t sample_period;
+        const std::chrono::microseconds poll_interval;
+        const size_t mask;
+        std::unique_ptr<Cell[]> cells;
+
+        alignas(64) std::atomic<size_t> enqueue_position = 0;
+        alignas(64) std::atomic<size_t> dequeue_position = 0;
+        alignas(64) std::atomic<size_t> written = 0;
+        std::atomic<uint64_t> dropped_records = 0;
+        std::atomic<uint64_t> skipped = 0;
+        std::atomic<bool> closed = false;
+        std::thread thread;
+
+        static size_t round_up_power_of_two(const size_t value) {
+            size_t result = 2;
+            while (result < value) result <<= 1;
+            return result;
+        }
+
+        static int open_file(const std::string &path) {
+            const auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd < 0) throw std::runtime_error("Could not open " + path);
+            return fd;
+        }
+
+        size_t size() const {
+            return enqueue_position.load(std::memory_order_relaxed) - dequeue_position.load(std::memory_order_relaxed);
+        }
+
+        bool try_push(const Record &record) {
+            auto position = enqueue_position.load(std::memory_order_relaxed);
+            Cell *cell;
+            while (true) {
+                cell = &cells[position & mask];
+                const auto sequence = cell->sequence.load(std::memory_order_acquire);
+                const auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+                if (difference == 0) {
+                    if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = enqueue_position.load(std::memory_order_relaxed);
+                }
+            }
+            cell->record = record;
+            cell->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// Single consumer, i.e., only called from the writer thread
+        bool try_pop(Record &record) {
+            const auto position = dequeue_position.load(std::memory_order_relaxed);
+            auto &cell = cells[position & mask];
+            if (cell.sequence.load(std::memory_order_acquire) != position + 1) return false;
+            record = cell.record;
+            cell.sequence.store(position + mask + 1, std::memory_order_release);
+            dequeue_position.store(position + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        void run() {
+            std::vector<char> buffer;
+            std::unordered_map<uint32_t, std::string> identifiers;
+            Record record;
+
+            const auto append_number = [&](const uint64_t value) {
+                char digits[24];
+                const auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+                buffer.insert(buffer.end(), digits, end);
+            };
+            const auto write_buffer = [&] {
+                for (size_t offset = 0; offset < buffer.size();) {
+                    const auto bytes = ::write(fd, buffer.data() + offset, buffer.size() - offset);
+                    if (bytes <= 0) break;
+                    offset += bytes;
+                }
+                buffer.clear();
+            };
+
+            while (true) {
+                // Read closed before draining, i.e., records pushed before closing are always written
+                const auto closing = closed.load(std::memory_order_acquire);
+
+                size_t batch = 0;
+                while (try_pop(record)) {
+                    const auto name = record.name();
+                    buffer.insert(buffer.end(), name.begin(), name.end());
+                    const std::string_view time = " time_ns=";
+                    buffer.insert(buffer.end(), time.begin(), time.end());
+                    append_number(static_cast<uint64_t>(std::llround(record.time_delta_ns)));
+
+                    for (size_t i = 0; i < std::min<size_t>(record.event_count, Record::max_events); i++) {
+                        auto it = identifiers.find(record.events[i]);
+                        if (it == identifiers.end()) {
+                            it = identifiers.emplace(record.events[i], identifier(static_cast<Event>(record.events[i])))
+                                         .first;
+                        }
+                        buffer.push_back(' ');
+                        buffer.insert(buffer.end(), it->second.begin(), it->second.end());
+                        buffer.push_back('=');
+                        append_number(record.values[i]);
+                    }
+                    buffer.push_back('\n');
+
+                    // Batched writes
+                    if (++batch % 256 == 0) {
+                        write_buffer();
+                        written.fetch_add(256, std::memory_order_release);
+                    }
+                }
+                write_buffer();
+                written.fetch_add(batch % 256, std::memory_order_release);
+
+                if (closing) return;
+                if (batch == 0) std::this_thread::sleep_for(poll_interval);
+            }
+        }
+    };
+#else
+    /**
+     * Perf::AsyncWriter with instrumentation disabled at compile time (PERF_MACOS_DISABLE).
+     * Starts no thread, opens no file and drops every record.
+     */
+    struct AsyncWriter {
+        enum Backpressure { drop, block, sample };
+
+        explicit AsyncWriter(const int = STDOUT_FILENO, const Backpressure = drop, const size_t = 4096,
+                             const size_t = 8, const std::chrono::microseconds = std::chrono::microseconds(500)) {}
+        explicit AsyncWriter(const std::string &, const Backpressure = drop, const size_t = 4096, const size_t = 8) {}
+
+        AsyncWriter(const AsyncWriter &) = delete;
+        AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+        bool push(const Record &) { return false; }
+        bool push(const Measurement<uint64_t> &, const std::string_view = {}) { return false; }
+        void flush() const {}
+        uint64_t dropped() const { return 0; }
+    };
+#endif
+
+    /**
+     * Instruction mix of a code region, i.e., which share of the executed
+     * instructions are loads, stores, branches, divisions and SIMD instructions
+     * of which width. Explains unexpected instructions_retired figures without
+     * reading disassembly, e.g., a loop that did not vectorize or an integer
+     * division that was not strength reduced.
+     *
+     * Machine code is decoded with a built-in x86-64 length and class decoder,
+     * either statically over a given address range (of_range()), or weighted by
+     * how often each instruction was sampled while running a function
+     * (sample()). Sampling uses ITIMER_PROF, i.e., has millisecond resolution
+     * and samples every thread of the process. Pass the address range of the
+     * hot function to exclude unrelated code. Samples land on instructions in
+     * proportion to the time spent on them, i.e., slow instructions such as
+     * divisions or missing loads weigh more than their execution count, and
+     * are often attributed to the following instruction (skid).
+     *
+     * The decoder covers legacy, VEX and EVEX encoded instructions as emitted
+     * by compilers. Memory operands are classified by opcode (e.g., add to
+     * memory is both load and store), implicit stack accesses of push, pop,
+     * call and ret are not counted.
+     */
+    struct InstructionMix {
+        /// Instruction classes. An instruction may belong to several classes, e.g., a vector load
+        enum Class : uint32_t {
+            load = 1 << 0,
+            store = 1 << 1,
+            branch = 1 << 2,
+            division = 1 << 3,
+            simd_scalar = 1 << 4,
+            simd_128 = 1 << 5,
+            simd_256 = 1 << 6,
+            simd_512 = 1 << 7,
+        };
+        static constexpr size_t class_count = 8;
+
+        /// Decoded x86-64 instruction
+        struct Instruction {
+            size_t length;
+            /// Bitwise or of Class
+            uint32_t classes;
+            /// Target of a relative branch or address of a RIP-relative memory operand, nullptr otherwise
+            const uint8_t *target;
+        };
+
+        /// Sampled instruction address
+        struct Hotspot {
+            const void *address;
+            uint64_t samples;
+            Instruction instruction;
+        };
+
+        /**
+         * Decodes the length and classes of the x86-64 instruction at code.
+         * Reads at most 15 bytes
+         */
+        static Instruction decode(const uint8_t *code) {
+            size_t i = 0;
+            bool operand_size = false, address_size = false, rex_w = false;
+            uint8_t repeat = 0;
+            for (; i < 14; i++) {
+                const auto prefix = code[i];
+                if (prefix == 0x66) operand_size = true;
+                else if (prefix == 0x67) address_size = true;
+                else if (prefix == 0xF2 || prefix == 0xF3) repeat = prefix;
+                else if (prefix != 0xF0 && prefix != 0x2E && prefix != 0x36 && prefix != 0x3E && prefix != 0x26 &&
+                         prefix != 0x64 && prefix != 0x65) {
+                    break;
+                }
+            }
+            // SIMD prefix as encoded in VEX.pp: none, 66, F3, F2
+            uint8_t pp = repeat == 0xF3 ? 2 : repeat == 0xF2 ? 3 : operand_size ? 1 : 0;
+            if ((code[i] & 0xF0) == 0x40) rex_w = code[i++] & 0x08;
+
+            // Opcode map: 0 one byte, 1 0F, 2 0F38, 3 0F3A (VEX/EVEX: mmmmm)
+            unsigned map = 0, width = 0;
+            bool vector = false;
+            if (code[i] == 0xC5) {
+                vector = true;
+                map = 1;
+                width = code[i + 1] & 0x04 ? 256 : 128;
+                pp = code[i + 1] & 0x03;
+                i += 2;
+            } else if (code[i] == 0xC4) {
+                vector = true;
+                map = code[i + 1] & 0x1F;
+                rex_w = code[i + 2] & 0x80;
+                width = code[i + 2] & 0x04 ? 256 : 128;
+                pp = code[i + 2] & 0x03;
+                i += 3;
+            } else if (code[i] == 0x62) {
+                vector = true;
+                map = code[i + 1] & 0x07;
+                rex_w = code[i + 2] & 0x80;
+                pp = code[i + 2] & 0x03;
+                width = 128u << std::min((code[i + 3] >> 5) & 0x03, 2);
+                i += 4;
+            } else if (code[i] == 0x0F) {
+                map = 1;
+                if (code[i + 1] == 0x38 || code[i + 1] == 0x3A) map = code[++i] == 0x38 ? 2 : 3;
+                i++;
+            }
+            const auto opcode = code[i++];
+
+            // ModR/M, SIB and displacement
+            bool modrm;
+            if (vector) modrm = !(map == 1 && opcode == 0x77);
+            else if (map == 0) modrm = has_modrm(opcode);
+            else if (map == 1) modrm = has_modrm_0f(opcode);
+            else modrm = true;
+
+            uint8_t mod = 3, reg = 0;
+            size_t rip_displacement = 0;
+            if (modrm) {
+                const auto byte = code[i++];
+                mod = byte >> 6;
+                reg = (byte >> 3) & 0x07;
+                const auto rm = byte & 0x07;
+                if (mod != 3 && rm == 4) {
+                    const auto base = code[i++] & 0x07;
+                    if (mod == 0 && base == 5) i += 4;
+                }
+                if (mod == 0 && rm == 5) {
+                    rip_displacement = i;
+                    i += 4;
+                }
+                if (mod == 1) i += 1;
+                if (mod == 2) i += 4;
+            }
+
+            // Immediates
+            const size_t z = operand_size ? 2 : 4;
+            if (map == 0) {
+                if (opcode < 0x40 && (opcode & 0x07) == 4) i += 1;
+                else if (opcode < 0x40 && (opcode & 0x07) == 5) i += z;
+                else if (opcode == 0x68 || opcode == 0x69 || opcode == 0x81 || opcode == 0xA9 || opcode == 0xC7) i += z;
+                else if (opcode == 0xE8 || opcode == 0xE9) i += 4;
+                else if (opcode == 0x6A || opcode == 0x6B || (opcode >= 0x70 && opcode <= 0x7F) || opcode == 0x80 ||
+                         opcode == 0x83 || opcode == 0xA8 || (opcode >= 0xB0 && opcode <= 0xB7) || opcode == 0xC0 ||
+                         opcode == 0xC1 || opcode == 0xC6 || opcode == 0xCD || (opcode >= 0xE0 && opcode <= 0xE7) ||
+                         opcode == 0xEB) {
+                    i += 1;
+                } else if (opcode >= 0xB8 && opcode <= 0xBF) i += rex_w ? 8 : z;
+                else if (opcode == 0xC2 || opcode == 0xCA) i += 2;
+                else if (opcode == 0xC8) i += 3;
+                else if (opcode >= 0xA0 && opcode <= 0xA3) i += address_size ? 4 : 8;
+                else if (opcode == 0xF6 && reg < 2) i += 1;
+                else if (opcode == 0xF7 && reg < 2) i += z;
+            } else if (map == 1) {
+                if ((opcode >= 0x70 && opcode <= 0x73) || opcode == 0xA4 || opcode == 0xAC || opcode == 0xBA ||
+                    opcode == 0xC2 || (opcode >= 0xC4 && opcode <= 0xC6)) {
+                    i += 1;
+                } else if (opcode >= 0x80 && opcode <= 0x8F) i += 4;
+            } else if (map == 3) {
+                i += 1;
+            }
+
+            // Classes
+            uint32_t classes = 0;
+            const bool memory = modrm && mod != 3 && !(map == 0 && opcode == 0x8D) && !(map == 1 && opcode == 0x1F);
+            if (memory) classes |= memory_access(map, opcode, reg, pp, vector);
+
+            if (map == 0) {
+                if ((opcode >= 0x70 && opcode <= 0x7F) || (opcode >= 0xE0 && opcode <= 0xE3) || opcode == 0xC2 ||
+                    opcode == 0xC3 || opcode == 0xCA || opcode == 0xCB || opcode == 0xE8 || opcode == 0xE9 ||
+                    opcode == 0xEB || (opcode == 0xFF && reg >= 2 && reg <= 5)) {
+                    classes |= branch;
+                }
+                if (((opcode == 0xF6 || opcode == 0xF7) && reg >= 6) ||
+                    ((opcode == 0xD8 || opcode == 0xDC || opcode == 0xDE) && reg >= 6)) {
+                    classes |= division;
+                }
+            } else if (map == 1 && !vector && opcode >= 0x80 && opcode <= 0x8F) {
+                classes |= branch;
+            }
+            if (map == 1 && opcode == 0x5E) classes |= division;
+
+            // VEX encoded general purpose (BMI) and mask register instructions are not SIMD
+            const bool mask = vector && map == 1 &&
+                              ((opcode >= 0x41 && opcode <= 0x4B) || (opcode >= 0x90 && opcode <= 0x93) ||
+                               opcode == 0x98 || opcode == 0x99);
+            const bool simd = vector ? !((map == 2 || map == 3) && opcode >= 0xF0) && !mask && opcode != 0x77
+                                     : (map == 1 && is_simd_0f(opcode)) || (map == 2 && opcode < 0xF0) || map == 3;
+            if (simd) {
+                const bool scalar =
+                        map == 1 &&
+                        ((pp >= 2 && (opcode == 0x10 || opcode == 0x11 || opcode == 0x2A || opcode == 0x2C ||
+                                      opcode == 0x2D || opcode == 0x51 || opcode == 0x5A ||
+                                      (opcode >= 0x58 && opcode <= 0x5F && opcode != 0x5B) || opcode == 0xC2)) ||
+                         (pp <= 1 && (opcode == 0x2E || opcode == 0x2F)));
+                if (scalar) classes |= simd_scalar;
+                else if (width == 512) classes |= simd_512;
+                else if (width == 256) classes |= simd_256;
+                else classes |= simd_128;
+            }
+
+            // Relative targets. Displacements are relative to the end of the instruction
+            const uint8_t *target = nullptr;
+            if (rip_displacement != 0) {
+                target = code + i + read_rel32(code + rip_displacement);
+            } else if (map == 0 && ((opcode >= 0x70 && opcode <= 0x7F) || (opcode >= 0xE0 && opcode <= 0xE3) ||
+                                    opcode == 0xEB)) {
+                target = code + i + static_cast<int8_t>(code[i - 1]);
+            } else if ((map == 0 && (opcode == 0xE8 || opcode == 0xE9)) ||
+                       (map == 1 && !vector && opcode >= 0x80 && opcode <= 0x8F)) {
+                target = code + i + read_rel32(code + i - 4);
+            }
+
+            return {std::min<size_t>(i, 15), classes, target};
+        }
+
+        /**
+         * Static instruction mix of the machine code in [begin, end), every
+         * instruction weighted once. begin must point to an instruction
+         * boundary, e.g., a function's address
+         */
+        static InstructionMix of_range(const void *begin, const void *end) {
+            InstructionMix mix;
+            for (auto code = static_cast<const uint8_t *>(begin); code < static_cast<const uint8_t *>(end);) {
+                const auto instruction = decode(code);
+                mix.add({code, 1, instruction});
+                code += instruction.length;
+            }
+            mix.sort();
+            return mix;
+        }
+
+        /**
+         * Dynamic instruction mix of fn, weighted by how often each instruction
+         * was sampled. fn is invoked repeatedly until min_samples samples are
+         * taken or max_duration (wall time) passed, at least once. Time spent
+         * in the kernel or blocked is not sampled.
+         *
+         * Not reentrant, i.e., only one sample() may run per process at a time.
+         *
+         * @param fn code region to sample
+         * @param begin if not null, only samples in [begin, end) are considered, e.g., the hot function
+         * @param end end of the considered address range
+         * @param min_samples minimum amount of samples taken (in any code)
+         * @param interval sampling interval in process CPU time
+         * @param max_duration wall time after which fn is no longer invoked, even with fewer samples
+         */
+        template<class F>
+        static InstructionMix sample(F &&fn, const void *begin = nullptr, const void *end = nullptr,
+                                     const size_t min_samples = 1000,
+                                     const std::chrono::microseconds interval = std::chrono::microseconds(1000),
+                                     const std::chrono::milliseconds max_duration = std::chrono::seconds(10)) {
+            std::vector<uintptr_t> buffer(std::max<size_t>(min_samples, 1) * 2);
+            sample_buffer() = buffer.data();
+            sample_capacity() = buffer.size();
+            sample_count().store(0, std::memory_order_relaxed);
+
+            struct sigaction action {};
+            struct sigaction previous_action {};
+            action.sa_sigaction = on_profile_signal;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if (sigaction(SIGPROF, &action, &previous_action) != 0) throw std::runtime_error("sigaction failed");
+
+            itimerval timer{};
+            itimerval previous_timer{};
+            timer.it_interval.tv_sec = interval.count() / 1000000;
+            timer.it_interval.tv_usec = interval.count() % 1000000;
+            timer.it_value = timer.it_interval;
+            if (setitimer(ITIMER_PROF, &timer, &previous_timer) != 0) {
+                sigaction(SIGPROF, &previous_action, nullptr);
+                throw std::runtime_error("setitimer failed");
+            }
+
+            const auto deadline = std::chrono::steady_clock::now() + max_duration;
+            try {
+                do {
+                    fn();
+                } while (sample_count().load(std::memory_order_relaxed) < min_samples &&
+                         std::chrono::steady_clock::now() < deadline);
+            } catch (...) {
+                setitimer(ITIMER_PROF, &previous_timer, nullptr);
+                sigaction(SIGPROF, &previous_action, nullptr);
+                throw;
+            }
+
+            setitimer(ITIMER_PROF, &previous_timer, nullptr);
+            sigaction(SIGPROF, &previous_action, nullptr);
+            const auto samples = std::min(sample_count().load(std::memory_order_relaxed), buffer.size());
+
+            std::unordered_map<uintptr_t, uint64_t> histogram;
+            for (size_t i = 0; i < samples; i++) {
+                const auto pc = buffer[i];
+                if (begin != nullptr && (pc < reinterpret_cast<uintptr_t>(begin) ||
+                                         pc >= reinterpret_cast<uintptr_t>(end))) {
+                    continue;
+                }
+                histogram[pc]++;
+            }
+
+            InstructionMix mix;
+            for (const auto &[pc, count] : histogram) {
+                const auto address = reinterpret_cast<const void *>(pc);
+                mix.add({address, count, decode(static_cast<const uint8_t *>(address))});
+            }
+            mix.sort();
+            return mix;
+        }
+
+        /// Total weight, i.e., decoded instructions (of_range()) or samples (sample())
+        uint64_t total() const { return total_weight; }
+
+        /// Weight of all instructions of a class
+        uint64_t weight(const Class instruction_class) const { return weights[class_index(instruction_class)]; }
+
+        /// Share of instructions of a class, in [0, 1]. Classes overlap, i.e., shares do not sum up to 1
+        long double fraction(const Class instruction_class) const {
+            return total_weight == 0 ? std::numeric_limits<long double>::quiet_NaN()
+                                     : static_cast<long double>(weight(instruction_class)) / total_weight;
+        }
+
+        /// Decoded instructions, heaviest first
+        const std::vector<Hotspot> &hotspots() const { return spots; }
+
+        static std::string class_name(const Class instruction_class) {
+            static const char *names[class_count] = {"Load",        "Store",    "Branch",   "Division",
+                                                     "SIMD scalar", "SIMD 128", "SIMD 256", "SIMD 512"};
+            return names[class_index(instruction_class)];
+        }
+
+        /**
+         * Pretty print the mix and the hottest instructions
+         *
+         * @param column_width width (in chars) of each table column
+         * @param hottest amount of hotspots to print
+         */
+        void pretty_print(unsigned int column_width = 15, size_t hottest = 10) const {
+            print_mix(column_width, std::numeric_limits<long double>::quiet_NaN());
+            print_hotspots(hottest);
+        }
+
+        /**
+         * Pretty print measurement alongside the mix, extrapolating the amount
+         * of instructions per class from its instructions_retired
+         *
+         * @param measurement measurement of the same code region
+         * @param column_width width (in chars) of each table column
+         * @param hottest amount of hotspots to print
+         */
+        template<class D>
+        void pretty_print(const Measurement<D> &measurement, unsigned int column_width = 15,
+                          size_t hottest = 10) const {
+            measurement.pretty_print(column_width);
+            const auto it = measurement.data.find(instructions_retired);
+            print_mix(column_width, it == measurement.data.end() ? std::numeric_limits<long double>::quiet_NaN()
+                                                                 : static_cast<long double>(it->second));
+            print_hotspots(hottest);
+        }
+
+    private:
+        std::vector<Hotspot> spots;
+        uint64_t weights[class_count] = {};
+        uint64_t total_weight = 0;
+
+        static size_t class_index(const Class instruction_class) { return __builtin_ctz(instruction_class); }
+
+        void add(const Hotspot &spot) {
+            spots.push_back(spot);
+            total_weight += spot.samples;
+            for (size_t c = 0; c < class_count; c++) {
+                if (spot.instruction.classes & (1u << c)) weights[c] += spot.samples;
+            }
+        }
+
+        void sort() {
+            std::stable_sort(spots.begin(), spots.end(),
+                             [](const Hotspot &a, const Hotspot &b) { return a.samples > b.samples; });
+        }
+
+        void print_mix(unsigned int column_width, const long double instructions) const {
+            std::cout << std::setw(column_width) << "Class" << std::setw(column_width) << "Share [%]"
+                      << std::setw(column_width) << "Instructions" << std::endl;
+            for (size_t c = 0; c < class_count; c++) {
+                const auto instruction_class = static_cast<Class>(1u << c);
+                std::cout << std::setw(column_width) << class_name(instruction_class) << std::setw(column_width)
+                          << std::to_string(100 * fraction(instruction_class)) << std::setw(column_width)
+                          << (std::isnan(instructions) ? std::string("-")
+                                                       : std::to_string(fraction(instruction_class) * instructions))
+                          << std::endl;
+            }
+            std::cout << "Weight: " << total_weight << std::endl;
+        }
+
+        void print_hotspots(const size_t hottest) const {
+            for (size_t i = 0; i < std::min(hottest, spots.size()); i++) {
+                const auto &spot = spots[i];
+                std::cout << "  " << spot.address << " " << std::setw(8) << spot.samples;
+                Dl_info info{};
+                if (dladdr(spot.address, &info) != 0 && info.dli_sname != nullptr) {
+                    std::cout << " " << info.dli_sname << "+"
+                              << (static_cast<const char *>(spot.address) - static_cast<const char *>(info.dli_saddr));
+                }
+                for (size_t c = 0; c < class_count; c++) {
+                    if (spot.instruction.classes & (1u << c)) {
+                        std::cout << " [" << class_name(static_cast<Class>(1u << c)) << "]";
+                    }
+                }
+                std::cout << std::endl;
+            }
+        }
+
+        // Signal handler state, function local statics to stay header only
+        static uintptr_t *&sample_buffer() {
+            static uintptr_t *buffer = nullptr;
+            return buffer;
+        }
+        static size_t &sample_capacity() {
+            static size_t capacity = 0;
+            return capacity;
+        }
+        static std::atomic<size_t> &sample_count() {
+            static std::atomic<size_t> count{0};
+            return count;
+        }
+
+        /// Async signal safe: records the interrupted program counter
+        static void on_profile_signal(int, siginfo_t *, void *context) {
+#if defined(__APPLE__)
+            const auto pc = static_cast<ucontext_t *>(context)->uc_mcontext->__ss.__rip;
+#else
+            const auto pc = static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
+#endif
+            const auto index = sample_count().fetch_add(1, std::memory_order_relaxed);
+            if (index < sample_capacity()) sample_buffer()[index] = static_cast<uintptr_t>(pc);
+        }
+
+        static int32_t read_rel32(const uint8_t *code) {
+            int32_t value;
+            std::memcpy(&value, code, sizeof(value));
+            return value;
+        }
+
+        static bool has_modrm(const uint8_t opcode) {
+            return (opcode < 0x40 && (opcode & 0x07) < 4) || opcode == 0x63 || opcode == 0x69 || opcode == 0x6B ||
+                   (opcode >= 0x80 && opcode <= 0x8F) || opcode == 0xC0 || opcode == 0xC1 || opcode == 0xC6 ||
+                   opcode == 0xC7 || (opcode >= 0xD0 && opcode <= 0xD3) || (opcode >= 0xD8 && opcode <= 0xDF) ||
+                   opcode == 0xF6 || opcode == 0xF7 || opcode == 0xFE || opcode == 0xFF;
+        }
+
+        static bool has_modrm_0f(const uint8_t opcode) {
+            return !((opcode >= 0x05 && opcode <= 0x09) || opcode == 0x0B || opcode == 0x0E ||
+                     (opcode >= 0x30 && opcode <= 0x37) || opcode == 0x77 || (opcode >= 0x80 && opcode <= 0x8F) ||
+                     (opcode >= 0xA0 && opcode <= 0xA2) || (opcode >= 0xA8 && opcode <= 0xAA) ||
+                     (opcode >= 0xC8 && opcode <= 0xCF));
+        }
+
+        static bool is_simd_0f(const uint8_t opcode) {
+            return (opcode >= 0x10 && opcode <= 0x17) || (opcode >= 0x28 && opcode <= 0x2F) ||
+                   (opcode >= 0x50 && opcode <= 0x7F && opcode != 0x77) || opcode == 0xC2 ||
+                   (opcode >= 0xC4 && opcode <= 0xC6) || (opcode >= 0xD0 && opcode <= 0xFE);
+        }
+
+        /// load and/or store for an instruction with a memory operand
+        static uint32_t memory_access(const unsigned map, const uint8_t opcode, const uint8_t reg, const uint8_t pp,
+                                      const bool vector) {
+            constexpr uint32_t load_store = load | store;
+            if (map == 0) {
+                // ALU with memory destination, except cmp
+                if (opcode < 0x40 && (opcode & 0x07) < 2) return (opcode & 0x38) == 0x38 ? load : load_store;
+                if (opcode >= 0x80 && opcode <= 0x83) return reg == 7 ? load : load_store;
+                if (opcode == 0x86 || opcode == 0x87 || opcode == 0xC0 || opcode == 0xC1 ||
+                    (opcode >= 0xD0 && opcode <= 0xD3)) {
+                    return load_store;
+                }
+                if (opcode == 0x88 || opcode == 0x89 || opcode == 0x8C || opcode == 0x8F || opcode == 0xC6 ||
+                    opcode == 0xC7) {
+                    return store;
+                }
+                if (opcode == 0xF6 || opcode == 0xF7) return reg == 2 || reg == 3 ? load_store : load;
+                if (opcode == 0xFE || opcode == 0xFF) return reg < 2 ? load_store : load;
+                return load;
+            }
+            if (map == 1) {
+                if (opcode == 0x11 || opcode == 0x13 || opcode == 0x17 || opcode == 0x29 || opcode == 0x2B ||
+                    opcode == 0x7F || opcode == 0xC3 || opcode == 0xD6 || opcode == 0xE7 ||
+                    (vector ? opcode == 0x91 : opcode >= 0x90 && opcode <= 0x9F)) {
+                    return store;
+                }
+                // F3 0F 7E is movq xmm, m64
+                if (opcode == 0x7E) return pp == 2 ? load : store;
+                if (opcode == 0xA4 || opcode == 0xA5 || opcode == 0xAB || opcode == 0xAC || opcode == 0xAD ||
+                    opcode == 0xB0 || opcode == 0xB1 || opcode == 0xB3 || opcode == 0xBB || opcode == 0xC0 ||
+                    opcode == 0xC1) {
+                    return load_store;
+                }
+                if (opcode == 0xBA) return reg == 4 ? load : load_store;
+                return load;
+            }
+            if (map == 2) {
+                // maskmov, scatter, compress and movbe m, r
+                if (opcode == 0x2E || opcode == 0x2F || opcode == 0x8E || (opcode >= 0xA0 && opcode <= 0xA3) ||
+                    opcode == 0x63 || opcode == 0x8A || opcode == 0x8B || (opcode == 0xF1 && pp != 3)) {
+                    return store;
+                }
+                return load;
+            }
+            if (map == 3) {
+                // Element and lane extracts
+                if ((opcode >= 0x14 && opcode <= 0x17) || opcode == 0x19 || opcode == 0x1B || opcode == 0x1D ||
+                    opcode == 0x39 || opcode == 0x3B) {
+                    return store;
+                }
+            }
+            return load;
+        }
+    };
+
+    /// Address range of machine code, e.g., recorded by PERF_MACOS_CODE_BEGIN and PERF_MACOS_CODE_END
+    struct CodeRange {
+        const void *begin = nullptr;
+        const void *end = nullptr;
+
+        size_t size() const {
+            return begin == nullptr || end <= begin
+                           ? 0
+                           : static_cast<const uint8_t *>(end) - static_cast<const uint8_t *>(begin);
+        }
+    };
+
+    /**
+     * Static throughput prediction of machine code by the locally installed
+     * llvm-mca, e.g., to compare what a hot loop should cost on the host CPU
+     * with what Perf::Counter measures. A measured cost far above the
+     * prediction points at memory effects (cache misses, TLB misses), which
+     * llvm-mca does not model, rather than at compute.
+     *
+     * The code range is disassembled with llvm-mc and simulated as the body of
+     * a loop, i.e., the range should cover exactly one loop iteration. Both
+     * tools ship with LLVM, e.g., `brew install llvm`, but not with Xcode.
+     */
+    struct Mca {
+        /// llvm-mca simulation results for one code range
+        struct Prediction {
+            uint64_t iterations;
+            long double total_cycles;
+            /// Simulated cycles per iteration
+            long double cycles_per_iteration;
+            /// Lower bound on cycles per iteration from resource usage only (Block RThroughput)
+            long double block_reciprocal_throughput;
+            long double ipc;
+            /// Dominant bottleneck of the simulation, e.g., "Resource Pressure: SKXPort1" or "Register Dependencies"
+            std::string bottleneck;
+            /// Disassembly handed to llvm-mca
+            std::string assembly;
+            /// Full llvm-mca report
+            std::string report;
+        };
+
+        /**
+         * @param tool_directory directory containing llvm-mc and llvm-mca, e.g.,
+         *      "/opt/homebrew/opt/llvm/bin". Empty to search PATH
+         * @param cpu llvm-mca -mcpu, defaults to the host CPU
+         * @param iterations simulated loop iterations
+         */
+        explicit Mca(const std::string &tool_directory = "", std::string cpu = "native",
+                     const uint64_t iterations = 100)
+            : llvm_mc(tool(tool_directory, "llvm-mc")), llvm_mca(tool(tool_directory, "llvm-mca")),
+              cpu(std::move(cpu)), iterations(iterations) {}
+
+        /// Disassembles range with llvm-mc into assembly llvm-mca accepts
+        std::string disassemble(const CodeRange &range) const {
+            if (range.size() == 0) throw std::invalid_argument("Empty code range. Were both markers executed?");
+
+            std::string bytes;
+            char hex[8];
+            for (size_t i = 0; i < range.size(); i++) {
+                snprintf(hex, sizeof(hex), "0x%02x ", static_cast<const uint8_t *>(range.begin)[i]);
+                bytes += hex;
+            }
+            const TemporaryFile input(bytes);
+            return run({llvm_mc, "--disassemble", input.path});
+        }
+
+        /**
+         * Innermost loop body in range, i.e., from the target of the shortest
+         * backward jump in range up to and including that jump. Markers around
+         * a loop also enclose its setup code, which llvm-mca would otherwise
+         * simulate as part of every iteration. Returns range if it contains no
+         * loop
+         */
+        static CodeRange innermost_loop(const CodeRange &range) {
+            CodeRange loop = range;
+#ifdef CPU_X86_64
+            const auto begin = static_cast<const uint8_t *>(range.begin);
+            const auto end = begin + range.size();
+            size_t shortest = std::numeric_limits<size_t>::max();
+            for (auto code = begin; code < end;) {
+                const auto instruction = InstructionMix::decode(code);
+                const auto next = code + instruction.length;
+                const auto target = instruction.target;
+                if ((instruction.classes & InstructionMix::branch) && target != nullptr && target >= begin &&
+                    target < next && static_cast<size_t>(next - target) < shortest) {
+                    shortest = next - target;
+                    loop = {target, next};
+                }
+                code = next;
+            }
+#endif
+            return loop;
+        }
+
+        /// Simulates range with llvm-mca on the configured CPU
+        Prediction predict(const CodeRange &range) const {
+            Prediction prediction{};
+            prediction.assembly = disassemble(range);
+
+            const TemporaryFile input(prediction.assembly);
+            prediction.report = run({llvm_mca, "-mcpu=" + cpu, "-iterations=" + std::to_string(iterations),
+                                     "-bottleneck-analysis", input.path});
+            parse(prediction);
+            return prediction;
+        }
+
+        /**
+         * Pretty print prediction next to the measured cycles per iteration
+         *
+         * @param prediction prediction of the loop body
+         * @param measurement measurement of the loop, averaged per iteration (see Measurement::averaged())
+         * @param column_width width (in chars) of each table column
+         */
+        template<class D>
+        static void pretty_print(const Prediction &prediction, const Measurement<D> &measurement,
+                                 unsigned int column_width = 15) {
+            const auto it = measurement.data.find(cycles);
+            const auto measured = it == measurement.data.end() ? std::numeric_limits<long double>::quiet_NaN()
+                                                               : static_cast<long double>(it->second);
+
+            std::cout << std::setw(column_width) << "Predicted" << std::setw(column_width) << "RThroughput"
+                      << std::setw(column_width) << "Measured" << std::setw(column_width) << "Gap" << std::endl;
+            std::cout << std::setw(column_width) << std::to_string(prediction.cycles_per_iteration)
+                      << std::setw(column_width) << std::to_string(prediction.block_reciprocal_throughput)
+                      << std::setw(column_width) << std::to_string(measured) << std::setw(column_width)
+                      << std::to_string(measured / prediction.cycles_per_iteration) << std::endl;
+            std::cout << "Bottleneck: " << prediction.bottleneck << std::endl;
+        }
+
+    private:
+        const std::string llvm_mc;
+        const std::string llvm_mca;
+        const std::string cpu;
+        const uint64_t iterations;
+
+        /// Removed on destruction
+        struct TemporaryFile {
+            std::string path;
+
+            explicit TemporaryFile(const std::string &content) {
+                path = (std::filesystem::temp_directory_path() / "perf-mca-XXXXXX").string();
+                const auto fd = mkstemp(path.data());
+                if (fd < 0) throw std::runtime_error("Could not create temporary file " + path);
+                const auto written = ::write(fd, content.data(), content.size());
+                close(fd);
+                if (written != static_cast<ssize_t>(content.size())) {
+                    unlink(path.c_str());
+                    throw std::runtime_error("Could not write temporary file " + path);
+                }
+            }
+            ~TemporaryFile() { unlink(path.c_str()); }
+
+            TemporaryFile(const TemporaryFile &) = delete;
+            TemporaryFile &operator=(const TemporaryFile &) = delete;
+        };
+
+        static std::string tool(const std::string &directory, const std::string &name) {
+            return directory.empty() ? name : (std::filesystem::path(directory) / name).string();
+        }
+
+        /**
+         * Runs a program without a shell, i.e., arguments are passed verbatim
+         *
+         * @param arguments program (searched in PATH unless it contains a slash) and its arguments
+         * @return combined stdout and stderr, throws if the program fails
+         */
+        static std::string run(const std::vector<std::string> &arguments) {
+            int fds[2];
+            if (pipe(fds) != 0) throw std::runtime_error("Could not create pipe for " + arguments[0]);
+
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+            posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+            posix_spawn_file_actions_addclose(&actions, fds[0]);
+            posix_spawn_file_actions_addclose(&actions, fds[1]);
+
+            std::vector<char *> argv;
+            for (const auto &argument : arguments) argv.push_back(const_cast<char *>(argument.c_str()));
+            argv.push_back(nullptr);
+
+            pid_t pid;
+            const auto spawned = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+            posix_spawn_file_actions_destroy(&actions);
+            close(fds[1]);
+            if (spawned != 0) {
+                close(fds[0]);
+                throw std::runtime_error("Could not run " + arguments[0] + ": " + std::strerror(spawned));
+            }
+
+            std::string output;
+            char buffer[4096];
+            ssize_t bytes;
+            while ((bytes = ::read(fds[0], buffer, sizeof(buffer))) != 0) {
+                if (bytes < 0 && errno == EINTR) continue;
+                if (bytes < 0) break;
+                output.append(buffer, bytes);
+            }
+            close(fds[0]);
+
+            int status = 0;
+            pid_t waited;
+            do {
+                waited = waitpid(pid, &status, 0);
+            } while (waited < 0 && errno == EINTR);
+            if (waited < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                throw std::runtime_error(arguments[0] + " failed: " + output);
+            }
+            return output;
+        }
+
+        /// Value of "<key>: <value>" summary lines
+        static long double summary_value(const std::string &report, const std::string &key) {
+            const auto position = report.find(key + ":");
+            if (position == std::string::npos) return std::numeric_limits<long double>::quiet_NaN();
+            return std::strtold(report.c_str() + position + key.size() + 1, nullptr);
+        }
+
+        /// Percentage of "<name> [ <percentage>% ]" bottleneck lines
+        static long double percentage(const std::string &line) {
+            const auto position = line.find('[');
+            return position == std::string::npos ? 0 : std::strtold(line.c_str() + position + 1, nullptr);
+        }
+
+        static void parse(Prediction &prediction) {
+            const auto &report = prediction.report;
+            prediction.iterations = static_cast<uint64_t>(summary_value(report, "Iterations"));
+            prediction.total_cycles = summary_value(report, "Total Cycles");
+            prediction.cycles_per_iteration = prediction.total_cycles / prediction.iterations;
+            prediction.block_reciprocal_throughput = summary_value(report, "Block RThroughput");
+            prediction.ipc = summary_value(report, "IPC");
+
+            // Throughput Bottlenecks section of -bottleneck-analysis
+            prediction.bottleneck = "none";
+            const auto section = report.find("Throughput Bottlenecks:");
+            if (section == std::string::npos) return;
+
+            std::istringstream lines(report.substr(section));
+            std::string line;
+            std::getline(lines, line);
+            long double resources = 0, best = 0;
+            std::string resource_names;
+            bool in_resources = false;
+            while (std::getline(lines, line) && !line.empty()) {
+                const auto name_begin = line.find_first_not_of(" -");
+                const auto name_end = line.find_last_not_of(" :", line.find('[') - 1);
+                const auto name = line.substr(name_begin, name_end - name_begin + 1);
+                const auto value = percentage(line);
+
+                if (line.find("Resource Pressure") != std::string::npos) {
+                    resources = value;
+                    in_resources = true;
+                } else if (line.find("Data Dependencies") != std::string::npos) {
+                    in_resources = false;
+                } else if (in_resources) {
+                    if (value > 0) resource_names += (resource_names.empty() ? "" : ", ") + name;
+                } else if (value > best) {
+                    best = value;
+                    prediction.bottleneck = name;
+                }
+            }
+            if (resources > 0 && resources >= best) prediction.bottleneck = "Resource Pressure: " + resource_names;
+        }
+    };
+
+    /**
+     * Copy of machine code in freshly mapped executable memory, e.g., to run
+     * a position independent kernel at a chosen address. Unmapped on
+     * destruction. Uses MAP_JIT on Apple silicon.
+     */
+    struct ExecutableMemory {
+        /**
+         * @param code machine code to copy
+         * @param size size of code in bytes
+         * @param offset offset of the copy from the (page aligned) start of the mapping
+         */
+        ExecutableMemory(const void *code, const size_t size, const size_t offset = 0)
+            : mapped_size(round_up_to_page(offset + std::max<size_t>(size, 1))) {
+#if defined(__APPLE__) && defined(CPU_ARM64)
+            base = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANON | MAP_JIT,
+                        -1, 0);
+            if (base == MAP_FAILED) throw std::runtime_error("Could not map executable memory");
+            pthread_jit_write_protect_np(0);
+            std::memcpy(static_cast<uint8_t *>(base) + offset, code, size);
+            pthread_jit_write_protect_np(1);
+#else
+            base = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+            if (base == MAP_FAILED) throw std::runtime_error("Could not map executable memory");
+            std::memcpy(static_cast<uint8_t *>(base) + offset, code, size);
+            if (mprotect(base, mapped_size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(base, mapped_size);
+                throw std::runtime_error("Could not make memory executable");
+            }
+#endif
+            entry_point = static_cast<uint8_t *>(base) + offset;
+            __builtin___clear_cache(static_cast<char *>(entry_point), static_cast<char *>(entry_point) + size);
+        }
+
+        ~ExecutableMemory() { munmap(base, mapped_size); }
+
+        ExecutableMemory(const ExecutableMemory &) = delete;
+        ExecutableMemory &operator=(const ExecutableMemory &) = delete;
+
+        /// Address of the copied code
+        void *entry() const { return entry_point; }
+
+        /// Copied code as a function pointer, e.g., as<void(uint64_t *, size_t)>()
+        template<class Signature>
+        Signature *as() const {
+            return reinterpret_cast<Signature *>(entry_point);
+        }
+
+    private:
+        const size_t mapped_size;
+        void *base;
+        void *entry_point;
+
+        static size_t round_up_to_page(const size_t size) {
+            const auto page = static_cast<size_t>(getpagesize());
+            return (size + page - 1) / page * page;
+        }
+    };
+
+    /**
+     * Code alignment sensitivity of microbenchmarks. Loop alignment, uop cache
+     * and branch predictor indexing make results shift when unrelated code
+     * moves (Mytkowicz et al., "Producing Wrong Data Without Doing Anything
+     * Obviously Wrong!", ASPLOS 2009). The sweep copies a position
+     * independent kernel to many offsets within fresh executable pages,
+     * measures each copy and reports the spread across placements.
+     *
+     * Kernels are plain functions without relative references out of their own
+     * code, i.e., without calls, jumps to other functions and RIP-relative data
+     * accesses (checked on x86-64). Leaf loops over pointer arguments qualify:
+     *
+     *   Perf::AlignmentSweep sweep;
+     *   sweep.measure("scalar", Perf::AlignmentSweep::function(&scalar), 100, values.data(), n);
+     *   sweep.measure("unrolled", Perf::AlignmentSweep::function(&unrolled), 100, values.data(), n);
+     *   sweep.pretty_print();
+     *
+     * A comparison survives realignment only if every placement of one kernel
+     * beats every placement of the other.
+     */
+    struct AlignmentSweep {
+        /// Measurement of one copy of a kernel, averaged per call
+        struct Placement {
+            size_t offset;
+            Measurement<long double> measurement;
+        };
+
+        /// All placements of one kernel and the spread of event across them
+        struct Result {
+            std::string name;
+            std::vector<Placement> placements;
+            long double mean;
+            long double standard_deviation;
+            long double min;
+            long double max;
+
+            /// (max - min) / min
+            long double spread() const { return (max - min) / min; }
+        };
+
+        /// Event the spread and comparisons are computed on
+        const Event event;
+        /// Spread above which a kernel is flagged as alignment sensitive
+        long double tolerance = 0.05;
+
+        /**
+         * @param events measured events, event is always measured
+         * @param event event the spread and comparisons are computed on
+         * @param offsets byte offsets of the copies within their pages, defaults to default_offsets()
+         */
+        explicit AlignmentSweep(std::vector<Event> events = {cycles, instructions_retired}, const Event event = cycles,
+                                std::vector<size_t> offsets = default_offsets())
+            : event(event), counter(with(std::move(events), event)), offsets(std::move(offsets)) {}
+
+        /// Every byte offset within the first cache line, then every cache line of the first page
+        static std::vector<size_t> default_offsets() {
+            std::vector<size_t> offsets;
+            for (size_t offset = 0; offset < 64; offset++) offsets.push_back(offset);
+            for (size_t offset = 64; offset < 4096; offset += 64) offsets.push_back(offset);
+            return offsets;
+        }
+
+        /**
+         * Extent of a leaf function on x86-64, i.e., from entry up to the ret,
+         * unconditional jmp or ud2 after which no branch of the function
+         * continues. Throws on padding (int3, zero bytes) before such an end.
+         * Loops entered by a forward jmp into their condition end the function
+         * early, i.e., fail the position independence check of measure()
+         */
+        static CodeRange function(const void *entry) {
+#ifdef CPU_X86_64
+            const auto begin = static_cast<const uint8_t *>(entry);
+            const uint8_t *furthest = begin;
+            for (auto code = begin; code < begin + max_function_size;) {
+                if (*code == 0xCC || *code == 0x00) {
+                    throw std::invalid_argument("Reached padding before the end of the function");
+                }
+                // Opcode after legacy and REX prefixes
+                auto opcode = code;
+                while (is_prefix(*opcode) && opcode < code + 14) opcode++;
+
+                const auto instruction = InstructionMix::decode(code);
+                const auto next = code + instruction.length;
+                const auto reg = (opcode[1] >> 3) & 7;
+                const bool jmp = *opcode == 0xE9 || *opcode == 0xEB || (*opcode == 0xFF && (reg == 4 || reg == 5));
+                const bool end = jmp || *opcode == 0xC3 || *opcode == 0xC2 || (opcode[0] == 0x0F && opcode[1] == 0x0B);
+                // No branch continues after the end, e.g., ret
+                if (end && next > furthest) return {begin, next};
+                // Calls leave the function, unconditional jmps that are not an end stay within
+                const bool call = *opcode == 0xE8;
+                if ((instruction.classes & InstructionMix::branch) && !call && instruction.target > furthest) {
+                    furthest = instruction.target;
+                }
+                code = next;
+            }
+            throw std::invalid_argument("Could not find the end of the function within " +
+                                        std::to_string(max_function_size) + " bytes");
+#else
+            (void) entry;
+            throw std::invalid_argument("Function extents are only supported on x86-64, pass a CodeRange");
+#endif
+        }
+
+        template<class R, class... Args>
+        static CodeRange function(R (*entry)(Args...)) {
+            return function(reinterpret_cast<const void *>(entry));
+        }
+
+        /**
+         * Measures a copy of kernel at every offset, after one warm up call per copy
+         *
+         * @param name name of the kernel, used for reporting
+         * @param kernel position independent machine code of a function taking args. Its return value is ignored
+         * @param calls calls per measurement, results are averaged per call
+         * @param args arguments passed to every call
+         */
+        template<class... Args>
+        const Result &measure(const std::string &name, const CodeRange &kernel, const size_t calls, Args... args) {
+            check_position_independent(kernel);
+            if (counter.counters_size() == 0) throw std::runtime_error("AlignmentSweep requires perf counters");
+
+            Result result{name, {}, 0, 0, std::numeric_limits<long double>::max(), 0};
+            for (const auto offset : offsets) {
+                const ExecutableMemory copy(kernel.begin, kernel.size(), offset);
+                const auto fn = copy.as<void(Args...)>();
+                fn(args...);
+
+                counter.start();
+                for (size_t i = 0; i < calls; i++) fn(args...);
+                result.placements.push_back({offset, counter.stop().averaged(calls)});
+            }
+
+            // Welford
+            size_t n = 0;
+            long double m2 = 0;
+            for (const auto &placement : result.placements) {
+                const auto value = placement.measurement.data.at(event);
+                const auto delta = value - result.mean;
+                result.mean += delta / ++n;
+                m2 += delta * (value - result.mean);
+                result.min = std::min(result.min, value);
+                result.max = std::max(result.max, value);
+            }
+            result.standard_deviation = n > 1 ? std::sqrt(m2 / (n - 1)) : 0;
+
+            results.push_back(std::move(result));
+            return results.back();
+        }
+
+        /// All kernels measured so far
+        const std::vector<Result> &measured() const { return results; }
+
+        /// Whether a beats b, or b beats a, at every placement
+        static bool survives(const Result &a, const Result &b) { return a.max < b.min || b.max < a.min; }
+
+        /**
+         * Pretty print the spread of every kernel, flagging alignment sensitive
+         * kernels and comparisons that do not survive realignment
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            std::cout << std::setw(column_width) << "Kernel";
+            for (const auto &header : {"Mean", "Stddev", "Min", "Max", "Spread [%]"}) {
+                std::cout << std::setw(column_width) << header;
+            }
+            std::cout << std::endl;
+
+            for (const auto &result : results) {
+                std::cout << std::setw(column_width) << result.name;
+                for (const auto value : {result.mean, result.standard_deviation, result.min, result.max}) {
+                    std::cout << std::setw(column_width) << std::to_string(value);
+                }
+                std::cout << std::setw(column_width) << std::to_string(100 * result.spread());
+                if (result.spread() > tolerance) std::cout << "  alignment sensitive";
+                std::cout << std::endl;
+            }
+
+            for (size_t i = 0; i < results.size(); i++) {
+                for (size_t j = i + 1; j < results.size(); j++) {
+                    if (survives(results[i], results[j])) continue;
+                    std::cout << "[Perf::AlignmentSweep] " << results[i].name << " vs " << results[j].name
+                              << ": ranking depends on code alignment" << std::endl;
+                }
+            }
+        }
+
+    private:
+        static constexpr size_t max_function_size = 1 << 14;
+
+        static bool is_prefix(const uint8_t byte) {
+            switch (byte) {
+                case 0x26:
+                case 0x2E:
+                case 0x36:
+                case 0x3E:
+                case 0x64:
+                case 0x65:
+                case 0x66:
+                case 0x67:
+                case 0xF0:
+                case 0xF2:
+                case 0xF3:
+                    return true;
+                default:
+                    // REX
+                    return (byte & 0xF0) == 0x40;
+            }
+        }
+
+        Counter counter;
+        const std::vector<size_t> offsets;
+        std::vector<Result> results;
+
+        static std::vector<Event> with(std::vector<Event> events, const Event event) {
+            if (std::find(events.begin(), events.end(), event) == events.end()) events.insert(events.begin(), event);
+            return events;
+        }
+
+        static void check_position_independent(const CodeRange &kernel) {
+            if (kernel.size() == 0) throw std::invalid_argument("Empty kernel");
+#ifdef CPU_X86_64
+            const auto begin = static_cast<const uint8_t *>(kernel.begin);
+            const auto end = begin + kernel.size();
+            for (auto code = begin; code < end;) {
+                const auto instruction = InstructionMix::decode(code);
+                if (instruction.target != nullptr && (instruction.target < begin || instruction.target >= end)) {
+                    throw std::invalid_argument("Kernel is not position independent: relative reference at offset " +
+                                                std::to_string(code - begin));
+                }
+                code += instruction.length;
+            }
+#endif
+        }
+    };
+
+    /**
+     * Measurement bias from memory layout. Stack offset (e.g., through the
+     * size of the environment) and heap placement change cache set and
+     * alignment conflicts, enough to fake or hide a few percent difference
+     * (Mytkowicz et al., ASPLOS 2009; Curtsinger and Berger, "Stabilizer",
+     * ASPLOS 2013). The randomizer measures code under a fresh random layout
+     * per repetition and reports distributions across layouts instead of a
+     * single, possibly biased, figure:
+     *
+     * - stack: the code runs below a random amount of alloca padding (in
+     *   steps of 16 bytes, the ABI stack alignment), which also emulates
+     *   environment size differences
+     * - heap: a random amount of random sized spacer blocks is allocated
+     *   before each repetition, shifting where the allocator places
+     *   subsequent allocations. Defining PERF_MACOS_RANDOMIZE_NEW in exactly
+     *   one translation unit before including this header additionally
+     *   replaces the global operator new with one that offsets every
+     *   allocation made during measurements by random padding
+     *
+     * Static data and code layout are fixed at link time and not randomized,
+     * i.e., relink with a different object order to cover link order, and use
+     * Perf::AlignmentSweep for code placement.
+     */
+    struct LayoutRandomizer {
+        /// Event the variants are compared on in pretty_print()
+        const Event event;
+        /// Maximum stack padding in bytes
+        size_t max_stack_padding = 4096;
+        /// Maximum amount of heap spacer blocks
+        size_t max_spacers = 64;
+        /// Maximum size of a heap spacer block in bytes
+        size_t max_spacer_size = 4096;
+
+        /**
+         * @param events measured events, event is always measured
+         * @param event event the variants are compared on in pretty_print()
+         * @param seed seed of all layout decisions, i.e., equal seeds reproduce layouts
+         */
+        explicit LayoutRandomizer(std::vector<Event> events = {cycles, instructions_retired, l1_misses},
+                                  const Event event = cycles, const uint64_t seed = std::random_device{}())
+            : event(event), counter(with(std::move(events), event)), rng(seed) {}
+
+        /**
+         * Measures fn under layouts random layouts, after one warm up call per layout
+         *
+         * @param name name of the variant, used for reporting
+         * @param fn code to measure
+         * @param layouts amount of random layouts
+         * @param calls calls per layout, measurements are averaged per call
+         * @return distribution of measurements across layouts
+         */
+        template<class F>
+        const Distribution &measure(const std::string &name, F &&fn, const size_t layouts = 100,
+                                    const size_t calls = 1) {
+            if (counter.counters_size() == 0) throw std::runtime_error("LayoutRandomizer requires perf counters");
+
+            auto it = std::find_if(variants.begin(), variants.end(),
+                                   [&](const auto &variant) { return variant.first == name; });
+            if (it == variants.end()) it = variants.insert(variants.end(), {name, Distribution()});
+
+            for (size_t layout = 0; layout < layouts; layout++) {
+                std::vector<void *> spacers(std::uniform_int_distribution<size_t>(0, max_spacers)(rng));
+                std::uniform_int_distribution<size_t> spacer_size(1, std::max<size_t>(max_spacer_size, 1));
+                for (auto &spacer : spacers) spacer = malloc(spacer_size(rng));
+
+                heap_seed().store(rng() | 1, std::memory_order_relaxed);
+                heap_generation().fetch_add(1, std::memory_order_relaxed);
+                heap_active().store(true, std::memory_order_relaxed);
+
+                const auto padding = std::uniform_int_distribution<size_t>(0, max_stack_padding / 16)(rng) * 16;
+                with_stack_padding(padding, [&] {
+                    fn();
+                    counter.start();
+                    for (size_t i = 0; i < calls; i++) fn();
+                    it->second.add(counter.stop().averaged(calls));
+                });
+
+                heap_active().store(false, std::memory_order_relaxed);
+                for (const auto spacer : spacers) free(spacer);
+            }
+            return it->second;
+        }
+
+        /// Distribution of a measured variant
+        const Distribution &distribution(const std::string &name) const {
+            for (const auto &[variant, distribution] : variants) {
+                if (variant == name) return distribution;
+            }
+            throw std::invalid_argument("Unknown variant " + name);
+        }
+
+        /**
+         * Pretty print p5, p50 and p95 of event per variant, relative to the
+         * first variant. Differences whose p5-p95 ranges overlap are within
+         * layout noise
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            std::cout << std::setw(column_width) << "Variant";
+            for (const auto &header : {"p5", "p50", "p95", "p50 vs first"}) {
+                std::cout << std::setw(column_width) << header;
+            }
+            std::cout << "  (" << human_readable_name(event) << ", " << randomized_allocations()
+                      << " randomized allocations)" << std::endl;
+
+            for (const auto &[name, distribution] : variants) {
+                const auto &first = variants.front().second;
+                const auto relative = distribution.quantile(event, 0.5) / first.quantile(event, 0.5) - 1;
+                std::cout << std::setw(column_width) << name;
+                for (const auto q : {0.05, 0.5, 0.95}) {
+                    std::cout << std::setw(column_width) << std::to_string(distribution.quantile(event, q));
+                }
+                std::cout << std::setw(column_width) << std::to_string(100 * relative) + "%";
+                if (&distribution != &first && distribution.quantile(event, 0.05) <= first.quantile(event, 0.95) &&
+                    first.quantile(event, 0.05) <= distribution.quantile(event, 0.95)) {
+                    std::cout << "  within layout noise";
+                }
+                std::cout << std::endl;
+            }
+        }
+
+        /// Allocation by the randomizing operator new (PERF_MACOS_RANDOMIZE_NEW)
+        __attribute__((noinline)) static void *allocate(const size_t size) {
+            size_t padding = 0;
+            if (heap_active().load(std::memory_order_relaxed)) {
+                // Per thread xorshift, reseeded per layout
+                thread_local uint64_t state = 0, generation = 0;
+                const auto current = heap_generation().load(std::memory_order_relaxed);
+                if (generation != current) {
+                    generation = current;
+                    state = heap_seed().load(std::memory_order_relaxed) ^
+                            (reinterpret_cast<uintptr_t>(&state) * 0x9E3779B97F4A7C15ull);
+                    if (state == 0) state = 1;
+                }
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                padding = (state % (max_heap_padding / 16)) * 16;
+                randomized_allocations_counter().fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // 16 byte header holding the offset of the returned pointer, keeps malloc's alignment
+            const auto offset = padding + 16;
+            auto *block = static_cast<uint8_t *>(malloc(size + offset));
+            if (block == nullptr) return nullptr;
+            std::memcpy(block + offset - sizeof(size_t), &offset, sizeof(size_t));
+            return block + offset;
+        }
+
+        /// Deallocation by the randomizing operator delete (PERF_MACOS_RANDOMIZE_NEW)
+        __attribute__((noinline)) static void deallocate(void *pointer) {
+            if (pointer == nullptr) return;
+            size_t offset;
+            std::memcpy(&offset, static_cast<uint8_t *>(pointer) - sizeof(size_t), sizeof(size_t));
+            free(static_cast<uint8_t *>(pointer) - offset);
+        }
+
+        /// Allocations offset by the randomizing operator new so far, 0 if it is not linked in
+        static uint64_t randomized_allocations() {
+            return randomized_allocations_counter().load(std::memory_order_relaxed);
+        }
+
+    private:
+        /// Maximum padding of the randomizing operator new, in steps of 16 bytes
+        static constexpr size_t max_heap_padding = 256;
+
+        Counter counter;
+        std::mt19937_64 rng;
+        std::vector<std::pair<std::string, Distribution>> variants;
+
+        static std::vector<Event> with(std::vector<Event> events, const Event event) {
+            if (std::find(events.begin(), events.end(), event) == events.end()) events.insert(events.begin(), event);
+            return events;
+        }
+
+        template<class F>
+        __attribute__((noinline)) static void with_stack_padding(const size_t padding, F &&fn) {
+            auto *pad = static_cast<volatile uint8_t *>(alloca(padding + 1));
+            pad[0] = 0;
+            fn();
+            // Keeps the padding alive across fn
+            asm volatile("" : : "r"(pad) : "memory");
+        }
+
+        // Operator new state, function local statics to stay header only
+        static std::atomic<bool> &heap_active() {
+            static std::atomic<bool> active{false};
+            return active;
+        }
+        static std::atomic<uint64_t> &heap_seed() {
+            static std::atomic<uint64_t> seed{1};
+            return seed;
+        }
+        static std::atomic<uint64_t> &heap_generation() {
+            static std::atomic<uint64_t> generation{0};
+            return generation;
+        }
+        static std::atomic<uint64_t> &randomized_allocations_counter() {
+            static std::atomic<uint64_t> count{0};
+            return count;
+        }
+    };
+
+    /**
+     * Minimal x86-64 machine code emitter for register forms of legacy and
+     * VEX encoded instructions, e.g., to generate microbenchmarks at runtime.
+     * Raw bytes can be mixed in via bytes(). Vector registers are plain
+     * indices, i.e., 0 is xmm0 or ymm0 depending on the vector length
+     */
+    struct Emitter {
+        enum Register : uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+        std::vector<uint8_t> code;
+
+        Emitter &bytes(std::initializer_list<uint8_t> values) {
+            code.insert(code.end(), values.begin(), values.end());
+            return *this;
+        }
+
+        Emitter &imm8(const uint8_t value) { return bytes({value}); }
+
+        Emitter &imm32(const uint32_t value) {
+            for (size_t i = 0; i < 4; i++) code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+            return *this;
+        }
+
+        /**
+         * Legacy encoded register-register instruction, i.e.,
+         * [prefix] [REX] opcode ModRM(11, reg, rm)
+         *
+         * @param opcode opcode bytes, including 0F escapes
+         * @param reg ModRM.reg register or opcode extension
+         * @param rm ModRM.rm register
+         * @param w REX.W, i.e., 64 bit operand size
+         * @param prefix mandatory prefix (66, F2 or F3), 0 for none
+         */
+        Emitter &legacy(std::initializer_list<uint8_t> opcode, const unsigned reg, const unsigned rm,
+                        const bool w = true, const uint8_t prefix = 0) {
+            if (prefix != 0) code.push_back(prefix);
+            if (w || reg > 7 || rm > 7) code.push_back(0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3));
+            code.insert(code.end(), opcode.begin(), opcode.end());
+            code.push_back(0xC0 | ((reg & 7) << 3) | (rm & 7));
+            return *this;
+        }
+
+        /**
+         * VEX encoded register form, i.e., VEX opcode ModRM(11, reg, rm)
+         *
+         * @param map opcode map: 1 for 0F, 2 for 0F38 and 3 for 0F3A
+         * @param pp implied prefix: 0 for none, 1 for 66, 2 for F3 and 3 for F2
+         * @param l256 VEX.L, i.e., 256 bit vectors
+         * @param w VEX.W
+         * @param reg ModRM.reg, usually the destination
+         * @param vvvv VEX.vvvv, usually the first source
+         * @param rm ModRM.rm, usually the second source
+         */
+        Emitter &vex(const unsigned map, const unsigned pp, const bool l256, const bool w, const uint8_t opcode,
+                     const unsigned reg, const unsigned vvvv, const unsigned rm) {
+            const uint8_t r = (~reg >> 3 & 1) << 7;
+            const uint8_t tail = ((~vvvv & 15) << 3) | (l256 << 2) | (pp & 3);
+            if (map == 1 && !w && rm < 8) {
+                bytes({0xC5, static_cast<uint8_t>(r | tail)});
+            } else {
+                bytes({0xC4, static_cast<uint8_t>(r | 0x40 | ((~rm >> 3 & 1) << 5) | (map & 0x1F)),
+                       static_cast<uint8_t>((w << 7) | tail)});
+            }
+            return bytes({opcode, static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7))});
+        }
+
+        Emitter &mov(const Register destination, const Register source) { return legacy({0x89}, source, destination); }
+
+        Emitter &mov(const Register destination, const uint64_t value) {
+            bytes({static_cast<uint8_t>(0x48 | (destination >> 3)), static_cast<uint8_t>(0xB8 | (destination & 7))});
+            for (size_t i = 0; i < 8; i++) code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+            return *this;
+        }
+
+        Emitter &add(const Register destination, const Register source) { return legacy({0x01}, source, destination); }
+
+        Emitter &imul(const Register destination, const Register source) {
+            return legacy({0x0F, 0xAF}, destination, source);
+        }
+
+        /// Unsigned division of rdx:rax by divisor
+        Emitter &div(const Register divisor) { return legacy({0xF7}, 6, divisor); }
+
+        Emitter &popcnt(const Register destination, const Register source) {
+            return legacy({0x0F, 0xB8}, destination, source, true, 0xF3);
+        }
+
+        Emitter &vaddps(const unsigned destination, const unsigned a, const unsigned b, const bool l256 = true) {
+            return vex(1, 0, l256, false, 0x58, destination, a, b);
+        }
+
+        Emitter &vmulps(const unsigned destination, const unsigned a, const unsigned b, const bool l256 = true) {
+            return vex(1, 0, l256, false, 0x59, destination, a, b);
+        }
+
+        Emitter &vpaddd(const unsigned destination, const unsigned a, const unsigned b, const bool l256 = true) {
+            return vex(1, 1, l256, false, 0xFE, destination, a, b);
+        }
+
+        /// destination += a * b
+        Emitter &vfmadd231ps(const unsigned destination, const unsigned a, const unsigned b, const bool l256 = true) {
+            return vex(2, 1, l256, false, 0xB8, destination, a, b);
+        }
+    };
+
+    /**
+     * Runtime generated instruction latency and throughput microbenchmarks,
+     * similar to uops.info, e.g., to evaluate instruction choices for SIMD
+     * kernels on a new CPU.
+     *
+     * An instruction generator emits one instance of the instruction for a
+     * given chain. The latency loop repeats the instance of chain 0, i.e.,
+     * every instance depends on the previous one through its destination. The
+     * throughput loop interleaves instances of independent chains. Both loops
+     * are unrolled, placed in executable memory and measured with the fixed
+     * loop overhead of one fused dec/jnz per unroll instructions included:
+     *
+     *   Perf::InstructionBenchmark benchmark;
+     *   benchmark.measure("imul r64, r64", [](Perf::Emitter &e, unsigned chain) {
+     *       const auto r = Perf::InstructionBenchmark::chain_register(chain);
+     *       e.imul(r, r);
+     *   });
+     *   benchmark.pretty_print();
+     *
+     * Chains may use chain_register(chain) and chain_vector(chain) freely;
+     * rcx and vector registers 12 to 15 remain available as constant
+     * operands, e.g., initialized by the setup generator. Instructions whose
+     * destination does not depend on its own previous value (zero idioms,
+     * eliminated moves) need an explicit dependency to measure latency.
+     *
+     * Port usage is measured with UOPS_DISPATCHED_PORT (Haswell to Coffee
+     * Lake numbering; later CPUs count some port pairs in one event).
+     */
+    struct InstructionBenchmark {
+        /// Emits one instance of an instruction (sequence) for a chain
+        using Generator = std::function<void(Emitter &, unsigned)>;
+
+        /// Per instruction figures
+        struct Result {
+            std::string name;
+            /// Cycles per instance in the dependency chain
+            long double latency;
+            /// Cycles per instance of independent chains, NaN for byte encoded instructions
+            long double reciprocal_throughput;
+            /// Executed uops per instance
+            long double uops;
+            /// Dispatched uops per instance, per port
+            std::vector<long double> ports;
+        };
+
+        static constexpr unsigned max_chains = 12;
+
+        /// Instances per loop iteration
+        size_t unroll = 64;
+        /// Loop iterations per measurement
+        uint64_t iterations = 10000;
+        /// Independent chains of the throughput loop, at most max_chains
+        unsigned chains = 8;
+        /// Whether to measure port usage, which runs the throughput loop once per group of perf registers
+        bool measure_ports = true;
+
+        /// General purpose register of a chain
+        static Emitter::Register chain_register(const unsigned chain) {
+            static constexpr Emitter::Register registers[max_chains] = {
+                    Emitter::rax, Emitter::rdx, Emitter::rsi, Emitter::r8,  Emitter::r9,  Emitter::r10,
+                    Emitter::r11, Emitter::rbx, Emitter::r12, Emitter::r13, Emitter::r14, Emitter::r15};
+            return registers[chain % max_chains];
+        }
+
+        /// Vector register of a chain
+        static unsigned chain_vector(const unsigned chain) { return chain % max_chains; }
+
+        /**
+         * Measures latency, reciprocal throughput and port usage of instruction
+         *
+         * @param name name of the instruction, used for reporting
+         * @param instruction emits one instance per call
+         * @param setup emits code run once per chain before the loop, e.g., to initialize registers
+         */
+        const Result &measure(const std::string &name, const Generator &instruction, const Generator &setup = {}) {
+            const auto instances = static_cast<long double>(iterations * unroll);
+            const auto per_instance = [&](const Measurement<uint64_t> &measurement, const Event event) {
+                const auto it = measurement.data.find(event);
+                return it == measurement.data.end() ? std::numeric_limits<long double>::quiet_NaN()
+                                                    : it->second / instances;
+            };
+
+            Result result{name, 0, 0, 0, {}};
+            {
+                const auto code = generate(instruction, setup, 1);
+                const ExecutableMemory memory(code.data(), code.size());
+                const auto loop = memory.as<void(uint64_t)>();
+                loop(iterations);
+                result.latency = per_instance(measure_grouped({cycles}, [&] { loop(iterations); }), cycles);
+            }
+            {
+                const auto code = generate(instruction, setup, std::clamp(chains, 1u, max_chains));
+                const ExecutableMemory memory(code.data(), code.size());
+                const auto loop = memory.as<void(uint64_t)>();
+                loop(iterations);
+
+                std::vector<Event> events = {cycles, uops_executed_thread};
+                if (measure_ports) events.insert(events.end(), port_events.begin(), port_events.end());
+                const auto measurement = measure_grouped(events, [&] { loop(iterations); });
+                result.reciprocal_throughput = per_instance(measurement, cycles);
+                result.uops = per_instance(measurement, uops_executed_thread);
+                if (measure_ports) {
+                    for (const auto &port : port_events) result.ports.push_back(per_instance(measurement, port));
+                }
+            }
+
+            results.push_back(std::move(result));
+            return results.back();
+        }
+
+        /**
+         * Measures a fixed byte encoded instruction. Its instances share
+         * registers, i.e., form a single chain, which leaves the reciprocal
+         * throughput unknown
+         */
+        const Result &measure(const std::string &name, const std::vector<uint8_t> &instruction) {
+            measure(name, [&](Emitter &emitter, unsigned) {
+                emitter.code.insert(emitter.code.end(), instruction.begin(), instruction.end());
+            });
+            results.back().reciprocal_throughput = std::numeric_limits<long double>::quiet_NaN();
+            return results.back();
+        }
+
+        /// All instructions measured so far
+        const std::vector<Result> &measured() const { return results; }
+
+        /**
+         * Generated loop function void(uint64_t iterations): saves callee
+         * saved registers, runs setup per chain, then the 64 byte aligned loop
+         * of unroll instances interleaving the given amount of chains
+         */
+        std::vector<uint8_t> generate(const Generator &instruction, const Generator &setup,
+                                      const unsigned loop_chains) const {
+            Emitter emitter;
+            // push rbx, rbp, r12, r13, r14, r15
+            emitter.bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+            if (setup) {
+                for (unsigned chain = 0; chain < loop_chains; chain++) setup(emitter, chain);
+            }
+            while (emitter.code.size() % 64 != 0) emitter.bytes({0x90});
+
+            const auto loop_begin = emitter.code.size();
+            for (size_t i = 0; i < unroll; i++) instruction(emitter, static_cast<unsigned>(i % loop_chains));
+            // dec rdi, jnz loop_begin
+            emitter.bytes({0x48, 0xFF, 0xCF, 0x0F, 0x85});
+            emitter.imm32(static_cast<uint32_t>(static_cast<int32_t>(loop_begin - (emitter.code.size() + 4))));
+
+            // vzeroupper, pop r15, r14, r13, r12, rbp, rbx, ret
+            if (uses_vex(emitter.code)) emitter.bytes({0xC5, 0xF8, 0x77});
+            emitter.bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3});
+            return emitter.code;
+        }
+
+        /**
+         * Pretty print one row per measured instruction
+         *
+         * @param column_width width (in chars) of each table column
+         */
+        void pretty_print(unsigned int column_width = 15) const {
+            std::cout << std::setw(column_width) << "Instruction" << std::setw(column_width) << "Latency"
+                      << std::setw(column_width) << "RThroughput" << std::setw(column_width) << "Uops";
+            for (size_t port = 0; port < port_events.size(); port++) {
+                std::cout << std::setw(port_column_width) << "P" + std::to_string(port);
+            }
+            std::cout << std::endl;
+
+            const auto format = [](const long double value) {
+                return std::isnan(value) ? std::string("-") : std::to_string(value);
+            };
+            for (const auto &result : results) {
+                std::cout << std::setw(column_width) << result.name << std::setw(column_width) << format(result.latency)
+                          << std::setw(column_width) << format(result.reciprocal_throughput)
+                          << std::setw(column_width) << format(result.uops);
+                for (const auto uops : result.ports) {
+                    std::cout << std::setw(port_column_width) << std::fixed << std::setprecision(2) << uops
+                              << std::defaultfloat;
+                }
+                std::cout << std::endl;
+            }
+        }
+
+    private:
+        static constexpr unsigned int port_column_width = 6;
+
+        std::vector<Result> results;
+
+        /// Whether code contains a VEX encoded instruction, i.e., requires vzeroupper
+        static bool uses_vex(const std::vector<uint8_t> &code) {
+            for (size_t i = 0; i < code.size();) {
+                if (code[i] == 0xC4 || code[i] == 0xC5) return true;
+                i += InstructionMix::decode(code.data() + i).length;
+            }
+            return false;
+        }
+    };
+}// namespace Perf
+
+#if defined(PERF_MACOS_RANDOMIZE_NEW) && !defined(PERF_MACOS_DISABLE)
+/**
+ * ==========================
+ *   Randomizing operator new
+ * ==========================
+ *
+ * Opt-in replacement of the global allocation functions for
+ * Perf::LayoutRandomizer. Define PERF_MACOS_RANDOMIZE_NEW in exactly one
+ * translation unit. Every allocation carries a 16 byte header, allocations
+ * made while LayoutRandomizer measures are additionally offset by random
+ * padding. Over-aligned allocations are not affected.
+ */
+void *operator new(std::size_t size) {
+    if (auto *pointer = Perf::LayoutRandomizer::allocate(size)) return pointer;
+    throw std::bad_alloc();
+}
+void *operator new[](std::size_t size) { return operator new(size); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return Perf::LayoutRandomizer::allocate(size);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return Perf::LayoutRandomizer::allocate(size);
+}
+void operator delete(void *pointer) noexcept { Perf::LayoutRandomizer::deallocate(pointer); }
+void operator delete[](void *pointer) noexcept { Perf::LayoutRandomizer::deallocate(pointer); }
+void operator delete(void *pointer, std::size_t) noexcept { Perf::LayoutRandomizer::deallocate(pointer); }
+void operator delete[](void *pointer, std::size_t) noexcept { Perf::LayoutRandomizer::deallocate(pointer); }
+void operator delete(void *pointer, const std::nothrow_t &) noexcept { Perf::LayoutRandomizer::deallocate(pointer); }
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept { Perf::LayoutRandomizer::deallocate(pointer); }
+#endif
 
 /**
  * ===================
@@ -439,6 +6145,7 @@ namespace Perf {
 
 #undef KPERF_FRAMEWORK_PATH
 #undef KPERF_FUNCTIONS_LIST
+#undef PERF_EVENTS_LIST
 
 #undef PERF_ERROR
 
@@ -0,0 +1,49 @@
+/**
+ * Command line interface for querying measurements persisted by a Perf::MeasurementLog.
+ *
+ * Example: p99 cycles of region probe grouped by build, only considering rows with more than 1000 LLC misses
+ *
+ *   ./perf-query perf-log --where region=probe --where "llc_misses>1000" --group-by build --select "p99(cycles)"
+ */
+#include "perf-macos.hpp"
+
+#include <iostream>
+#include <string>
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " <log directory> [--where <condition>]... [--group-by <label>]... [--select <aggregate>]..."
+                  << std::endl;
+        return 1;
+    }
+
+    try {
+        const auto table = Perf::ResultTable::from_log(argv[1]);
+        Perf::Query query(table);
+
+        bool selected = false;
+        for (int i = 2; i + 1 < argc; i += 2) {
+            const std::string option = argv[i];
+            const std::string value = argv[i + 1];
+            if (option == "--where") {
+                query.where(value);
+            } else if (option == "--group-by") {
+                query.group_by(value);
+            } else if (option == "--select") {
+                query.select(value);
+                selected = true;
+            } else {
+                throw std::invalid_argument("Unknown option: " + option);
+            }
+        }
+        if (!selected) query.select(Perf::Query::count);
+
+        query.run().pretty_print();
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
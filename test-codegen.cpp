@@ -0,0 +1,46 @@
+/**
+ * Verifies that instrumentation compiled with PERF_MACOS_DISABLE is free, i.e.,
+ * that kernel() and region_kernel() compile to identical machine code with and
+ * without the bracketing Perf::Counter, Perf::BlockCounter, Perf::RegionCounter
+ * and Perf::ThresholdCapture. See `make test-codegen`.
+ */
+#include "perf-macos.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" uint64_t kernel(const uint64_t *data, const size_t n) {
+#ifdef INSTRUMENTED
+    Perf::BlockCounter block(n);
+    Perf::Counter counter({Perf::cycles, Perf::instructions_retired});
+    counter.start();
+#endif
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += data[i] ^ (data[i] >> 7);
+
+#ifdef INSTRUMENTED
+    counter.stop();
+#endif
+    return sum;
+}
+
+extern "C" uint64_t region_kernel(const uint64_t *data, const size_t n, const Perf::Region &region) {
+#ifdef INSTRUMENTED
+    Perf::RegionCounter counter(region);
+    Perf::ThresholdCapture capture(Perf::cycles, 1000000, {Perf::cycles, Perf::l1_misses});
+    counter.start();
+    capture.start();
+#else
+    (void) region;
+#endif
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += data[i] * (data[i] | 1);
+
+#ifdef INSTRUMENTED
+    capture.stop();
+    counter.stop();
+#endif
+    return sum;
+}
@@ -1,7 +1,14 @@
 #include "perf-macos.hpp"
 
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 // https://www.youtube.com/watch?v=nXaxk27zwlk&t=2441s, improved version from
 // https://github.com/google/benchmark/blob/ba9a763def4eca056d03b1ece2946b2d4ef6dfcb/include/benchmark/benchmark.h#L326
@@ -44,9 +51,551 @@ void block_counter() {
     }
 }
 
+void pause_resume() {
+    const uint64_t n = 1000000;
+    std::vector<uint64_t> inputs(16);
+
+    Perf::Counter counter;
+    counter.start();
+
+    for (uint64_t i = 0; i < n; i++) {
+        // Exclude per-iteration setup work from the measurement
+        counter.pause();
+        for (auto &input : inputs) input = i ^ (input + 1);
+        counter.resume();
+
+        const auto val = 0xABCDEF03 / (inputs[i % inputs.size()] + 1);
+        DoNotEliminate(val);
+    }
+
+    // Only contains the active intervals. Measurement::pauses holds the amount of pauses
+    counter.stop().averaged(n).pretty_print();
+}
+
+void laps() {
+    const uint64_t n = 100000;
+    std::vector<uint64_t> table(n);
+
+    Perf::Counter counter;
+    counter.start();
+
+    // Build phase
+    for (uint64_t i = 0; i < n; i++) table[i] = i * 0x9E3779B97F4A7C15;
+    counter.lap("build");
+
+    // Probe phase
+    uint64_t hits = 0;
+    for (uint64_t i = 0; i < n; i++) hits += table[(i * 7) % n] & 1;
+    DoNotEliminate(hits);
+    counter.lap("probe");
+
+    // One row per lap followed by the total
+    counter.stop().averaged(n).pretty_print();
+}
+
+void user_kernel_split() {
+    const uint64_t n = 10000;
+    const auto fd = open("/dev/null", O_WRONLY);
+
+    // Count each event separately in user mode and kernel mode
+    Perf::Counter counter(Perf::split_modes({Perf::cycles, Perf::instructions_retired}));
+    counter.start();
+
+    // Syscall heavy code, e.g., small unbuffered writes
+    for (uint64_t i = 0; i < n; i++) {
+        const auto written = write(fd, &i, sizeof(i));
+        DoNotEliminate(written);
+    }
+
+    // User and kernel mode columns are printed side by side
+    counter.stop().averaged(n).pretty_print(18);
+    close(fd);
+}
+
+void memory_level_parallelism() {
+    const uint64_t n = 1 << 22;
+    std::vector<uint64_t> next(n);
+    for (uint64_t i = 0; i < n; i++) next[i] = (i * 0x9E3779B97F4A7C15) % n;
+
+    // Modified events enable derived metrics such as memory-level parallelism and stall episodes
+    Perf::Counter counter({Perf::zero_uop_cycles, Perf::stall_episodes, Perf::l1d_pend_miss_pending,
+                           Perf::l1d_pend_miss_cycles});
+
+    // Dependent loads (pointer chasing) serialize misses
+    uint64_t position = 0;
+    counter.start();
+    for (uint64_t i = 0; i < n; i++) position = next[position];
+    const auto dependent = counter.stop();
+    DoNotEliminate(position);
+
+    // Independent loads overlap misses
+    uint64_t sum = 0;
+    counter.start();
+    for (uint64_t i = 0; i < n; i++) sum += next[next[i]];
+    const auto independent = counter.stop();
+    DoNotEliminate(sum);
+
+    std::cout << "MLP dependent: " << dependent.memory_level_parallelism()
+              << ", independent: " << independent.memory_level_parallelism() << std::endl;
+    std::cout << "Average stall length [cycles] dependent: " << dependent.average_stall_length()
+              << ", independent: " << independent.average_stall_length() << std::endl;
+}
+
+void memory_stalls() {
+    const uint64_t n = 1 << 22;
+    std::vector<uint64_t> next(n);
+    for (uint64_t i = 0; i < n; i++) next[i] = (i * 0x9E3779B97F4A7C15) % n;
+
+    // Stall events are selected for the detected CPU
+    Perf::MemoryStalls stalls;
+
+    stalls.measure("dependent", [&] {
+        uint64_t position = 0;
+        for (uint64_t i = 0; i < n; i++) position = next[position];
+        DoNotEliminate(position);
+    });
+    stalls.measure("independent", [&] {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) sum += next[next[i]];
+        DoNotEliminate(sum);
+    });
+
+    stalls.pretty_print();
+}
+
+void autotuner() {
+    const uint64_t n = 1 << 20;
+    std::vector<uint64_t> data(n, 1);
+
+    // Parameter space and metric to minimize
+    Perf::Autotuner tuner("strided_sum");
+    tuner.parameter("block", {64, 256, 1024, 4096}).parameter("unroll", {1, 2, 4, 8}).minimize(Perf::cycles);
+
+    const auto best = tuner.tune(
+            [&](const Perf::Autotuner::Configuration &configuration) {
+                const auto block = configuration.at("block"), unroll = configuration.at("unroll");
+                uint64_t sum = 0;
+                for (int64_t begin = 0; begin < static_cast<int64_t>(n); begin += block) {
+                    for (int64_t i = begin; i < begin + block; i += unroll) {
+                        for (int64_t j = 0; j < unroll; j++) sum += data[i + j];
+                    }
+                }
+                DoNotEliminate(sum);
+            },
+            Perf::Autotuner::bayesian, 8);
+    tuner.pretty_print();
+
+    // Persist per machine, later runs may recall() instead of tuning
+    tuner.persist(best, "perf-tuning.tsv");
+    const auto recalled = tuner.recall("perf-tuning.tsv");
+    std::cout << "Best block: " << recalled->at("block") << ", unroll: " << recalled->at("unroll") << std::endl;
+}
+
+void selector() {
+    std::vector<uint64_t> data(1 << 16);
+    for (uint64_t i = 0; i < data.size(); i++) data[i] = (i * 0x9E3779B97F4A7C15) >> 40;
+
+    // Implementations of the same operation, selected by cycles per item at runtime
+    Perf::Selector<uint64_t(const std::vector<uint64_t> &, uint64_t)> count_less;
+    count_less
+            .add("branching",
+                 [](const std::vector<uint64_t> &values, const uint64_t pivot) {
+                     uint64_t count = 0;
+                     for (const auto value : values) {
+                         if (value < pivot) count++;
+                     }
+                     return count;
+                 })
+            .add("branchless", [](const std::vector<uint64_t> &values, const uint64_t pivot) {
+                uint64_t count = 0;
+                for (const auto value : values) count += value < pivot;
+                return count;
+            });
+
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < 1000; i++) total += count_less(data.size(), data, i << 14);
+    DoNotEliminate(total);
+
+    count_less.pretty_print();
+}
+
+void threshold_capture() {
+    // Capture executions exceeding 2000 cycles
+    Perf::ThresholdCapture capture(Perf::cycles, 2000);
+
+    for (uint64_t i = 0; i < 1000; i++) {
+        capture.start();
+        // Occasionally slow region
+        const uint64_t n = i % 100 == 0 ? 100000 : 100;
+        for (uint64_t j = 0; j < n; j++) DoNotEliminate(j);
+        capture.stop();
+    }
+
+    std::cout << "Captured " << capture.captures().size() << " slow executions" << std::endl;
+    if (!capture.captures().empty()) capture.captures().back().measurement.pretty_print();
+}
+
+void runtime_toggles() {
+    // Regions are registered once and checked on each execution
+    static Perf::Region region("toggled");
+    Perf::RegionCounter counter(region);
+
+    const auto run = [&] {
+        counter.start();
+        for (uint64_t i = 0; i < 1000; i++) DoNotEliminate(i);
+        return counter.stop();
+    };
+
+    // Disabled regions skip all counter reads, i.e., measurements are empty
+    Perf::Region::set("toggled", false);
+    std::cout << "Disabled region measured " << run().data.size() << " events" << std::endl;
+
+    // Enable via control file on SIGUSR1, e.g., `echo toggled=1 > perf-control && kill -USR1 <pid>`
+    std::ofstream("perf-control") << "toggled=1" << std::endl;
+    Perf::Region::watch("perf-control");
+    raise(SIGUSR1);
+    std::cout << "Enabled region measured " << run().data.size() << " events" << std::endl;
+    std::remove("perf-control");
+}
+
+void async_writer() {
+    // Formatting and writing happens on a background thread
+    Perf::AsyncWriter writer(STDOUT_FILENO, Perf::AsyncWriter::block);
+    Perf::Counter counter;
+
+    for (uint64_t i = 0; i < 4; i++) {
+        counter.start();
+        for (uint64_t j = 0; j < 1000; j++) DoNotEliminate(j);
+        writer.push(counter.stop(), "async");
+    }
+    writer.flush();
+}
+
+__attribute__((noinline)) uint64_t mix_kernel(const std::vector<uint64_t> &values) {
+    uint64_t sum = 0;
+    for (const auto value : values) sum += 0xABCDEF03 / (value + 1);
+    return sum;
+}
+
+void instruction_mix() {
+    std::vector<uint64_t> values(100000);
+    for (size_t i = 0; i < values.size(); i++) values[i] = i;
+
+    Perf::Counter counter;
+    counter.start();
+    DoNotEliminate(mix_kernel(values));
+    const auto measurement = counter.stop();
+
+    // Weighted by sampled frequency, extrapolated to the measured instructions_retired
+    const auto mix = Perf::InstructionMix::sample([&] { DoNotEliminate(mix_kernel(values)); }, nullptr, nullptr, 100);
+    mix.pretty_print(measurement);
+}
+
+void mca() {
+    std::vector<uint64_t> values(100000, 1);
+    Perf::CodeRange range;
+    Perf::Counter counter({Perf::cycles, Perf::instructions_retired});
+
+    counter.start();
+    uint64_t sum = 0;
+    PERF_MACOS_CODE_BEGIN(range);
+    for (const auto value : values) sum += value * value;
+    PERF_MACOS_CODE_END(range);
+    const auto measurement = counter.stop();
+    DoNotEliminate(sum);
+
+    // Static prediction of the loop body on the host CPU next to the measured cycles per iteration
+    try {
+        const auto prediction = Perf::Mca().predict(Perf::Mca::innermost_loop(range));
+        Perf::Mca::pretty_print(prediction, measurement.averaged(values.size()));
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+__attribute__((noinline)) void scale(uint64_t *values, const size_t n) {
+    for (size_t i = 0; i < n; i++) values[i] = values[i] * 3 + 1;
+}
+
+__attribute__((noinline)) void scale_unrolled(uint64_t *values, const size_t n) {
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        values[i] = values[i] * 3 + 1;
+        values[i + 1] = values[i + 1] * 3 + 1;
+    }
+}
+
+void alignment_sweep() {
+    std::vector<uint64_t> values(1000, 1);
+
+    // Copies of both kernels at 127 code offsets, flags rankings that depend on alignment
+    Perf::AlignmentSweep sweep;
+    sweep.measure("scale", Perf::AlignmentSweep::function(&scale), 100, values.data(), values.size());
+    sweep.measure("unrolled", Perf::AlignmentSweep::function(&scale_unrolled), 100, values.data(), values.size());
+    sweep.pretty_print();
+}
+
+void layout_randomization() {
+    std::vector<uint64_t> values(4096, 1);
+    const auto sum = [&](const size_t stride) {
+        std::vector<uint64_t> partial(8);
+        for (size_t i = 0; i < values.size(); i += stride) partial[i % partial.size()] += values[i];
+        DoNotEliminate(partial.data());
+    };
+
+    // Distributions across 50 random stack and heap layouts per variant
+    Perf::LayoutRandomizer randomizer;
+    randomizer.measure("stride 1", [&] { sum(1); }, 50);
+    randomizer.measure("stride 2", [&] { sum(2); }, 50);
+    randomizer.pretty_print();
+    randomizer.distribution("stride 1").pretty_print();
+}
+
+void instruction_benchmark() {
+    using Perf::InstructionBenchmark;
+    InstructionBenchmark benchmark;
+
+    benchmark.measure("imul r64, r64", [](Perf::Emitter &e, const unsigned chain) {
+        const auto r = InstructionBenchmark::chain_register(chain);
+        e.imul(r, r);
+    });
+    benchmark.measure("add r64, r64", [](Perf::Emitter &e, const unsigned chain) {
+        const auto r = InstructionBenchmark::chain_register(chain);
+        e.add(r, Perf::Emitter::rcx);
+    });
+    // Byte encoded instructions form a single chain, i.e., only their latency is meaningful
+    benchmark.measure("popcnt rax, rax", {0xF3, 0x48, 0x0F, 0xB8, 0xC0});
+    benchmark.pretty_print();
+}
+
+void roofline() {
+    const size_t n = 1 << 24;
+    std::vector<double> x(n, 1.0), y(n, 2.0);
+
+    // Measure machine peaks with built-in probes
+    auto roofline = Perf::Roofline::probe();
+
+    // Place code regions on the roofline. Each region may be invoked multiple times
+    roofline.measure("daxpy", [&] {
+        for (size_t i = 0; i < n; i++) y[i] = 0.5 * x[i] + y[i];
+        DoNotEliminate(y.data());
+    });
+    roofline.measure("polynomial", [&] {
+        for (size_t i = 0; i < n; i++) {
+            const auto v = x[i];
+            y[i] = (((v * 0.1 + 0.2) * v + 0.3) * v + 0.4) * v + 0.5;
+        }
+        DoNotEliminate(y.data());
+    });
+
+    roofline.pretty_print();
+}
+
+void vectorization() {
+    const size_t n = 1 << 20;
+    std::vector<float> x(n, 1.0f), y(n, 2.0f);
+
+    // There are more floating point events than perf registers. measure_grouped
+    // therefore executes the region once per group of events
+    const auto measurement = Perf::measure_grouped(Perf::fp_arith_events, [&] {
+        for (size_t i = 0; i < n; i++) y[i] = 0.5f * x[i] + y[i];
+        DoNotEliminate(y.data());
+    });
+
+    // Prints vectorization ratio and average vector width next to the raw counts
+    measurement.averaged(n).pretty_print();
+}
+
+void distribution() {
+    const uint64_t n = 10000;
+
+    // Fixed memory streaming quantiles of each event, regardless of the amount of measurements
+    Perf::Distribution distribution;
+    Perf::Counter counter;
+
+    for (uint64_t i = 0; i < n; i++) {
+        counter.start();
+        const auto val = 0xABCDEF03 / (i + 1);
+        DoNotEliminate(val);
+        distribution.add(counter.stop());
+    }
+
+    // Distributions of multiple threads or processes (see serialize()) can be merged
+    Perf::Distribution merged;
+    merged.merge(distribution);
+
+    merged.pretty_print();
+}
+
+void measurement_log() {
+    const uint64_t n = 1000;
+
+    {
+        // Crash safe, memory mapped log. Keeps at most 4 segments of 1 MiB on disk
+        Perf::MeasurementLog log("perf-log", 1 << 20, 4);
+        Perf::Counter counter;
+
+        for (uint64_t i = 0; i < n; i++) {
+            counter.start();
+            const auto val = 0xABCDEF03 / (i + 1);
+            DoNotEliminate(val);
+            log.append(counter.stop(), i % 2 == 0 ? "region=division,parity=even" : "region=division,parity=odd");
+        }
+    }
+
+    // Recover all complete records, e.g., after a crash
+    const auto records = Perf::MeasurementLog::recover("perf-log");
+    std::cout << "Recovered " << records.size() << " records" << std::endl;
+    if (!records.empty()) records.back().measurement().pretty_print();
+}
+
+void measurement_log_rotation() {
+    // Concurrent appends while tiny segments rotate and get evicted continuously
+    const std::string directory = "perf-log-rotation";
+    {
+        Perf::MeasurementLog log(directory, 4096, 2);
+        std::vector<std::thread> writers;
+        for (size_t t = 0; t < 8; t++) {
+            writers.emplace_back([&, t] {
+                for (uint64_t i = 0; i < 10000; i++) {
+                    log.append(Perf::Measurement<uint64_t>({{Perf::cycles, i}}, t), "rotation");
+                }
+            });
+        }
+        for (auto &writer : writers) writer.join();
+    }
+
+    const auto records = Perf::MeasurementLog::recover(directory);
+    std::cout << "Recovered " << records.size() << " records of the last 2 segments" << std::endl;
+    std::filesystem::remove_all(directory);
+}
+
+void counter_series() {
+    const uint64_t n = 1000;
+    const std::vector<Perf::Event> events = {Perf::instructions_retired, Perf::cycles};
+
+    // Periodic (cumulative) counter snapshots, delta-of-delta compressed
+    Perf::CounterSeries series(events);
+    Perf::Counter counter(events);
+    counter.configure();
+    std::vector<uint64_t> origin(counter.counters_size()), current(counter.counters_size());
+    counter.read(origin.data());
+
+    for (uint64_t i = 0; i < n; i++) {
+        const auto val = 0xABCDEF03 / (i + 1);
+        DoNotEliminate(val);
+
+        counter.read(current.data());
+        const auto timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        series.append(timestamp, counter.delta(origin.data(), current.data(), 0));
+    }
+
+    std::cout << "Compressed " << series.raw_bytes() << " to " << series.compressed_bytes() << " bytes" << std::endl;
+    series.between(0, n - 1).averaged(n - 1).pretty_print();
+}
+
+void query() {
+    // Columnar table of all measurements persisted by measurement_log()
+    const auto table = Perf::ResultTable::from_log("perf-log");
+
+    // p99 instructions and average elapsed time of region "division" grouped by parity where L1 misses > 1
+    Perf::Query(table)
+            .where("region=division")
+            .where("l1_misses>1")
+            .group_by("parity")
+            .select("count()")
+            .select("p99(instructions_retired)")
+            .select(Perf::Query::avg, "time_ns")
+            .run()
+            .pretty_print();
+}
+
+void aggregator() {
+    const uint64_t n = 10000;
+
+    // The consumer only ever runs on the aggregator thread, i.e., needs no synchronization
+    Perf::Distribution distribution;
+    {
+        Perf::Aggregator aggregator([&](const Perf::Record *records, size_t count) {
+            for (size_t i = 0; i < count; i++) distribution.add(records[i].measurement());
+        });
+
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < 4; t++) {
+            workers.emplace_back([&] {
+                Perf::Counter counter;
+                for (uint64_t i = 0; i < n; i++) {
+                    counter.start();
+                    const auto val = 0xABCDEF03 / (i + 1);
+                    DoNotEliminate(val);
+                    // No synchronization: records into a thread-local batch
+                    aggregator.record(counter.stop(), "division");
+                }
+                // Remaining records are flushed at thread exit
+            });
+        }
+        for (auto &worker : workers) worker.join();
+    }
+
+    distribution.pretty_print();
+}
+
+#ifdef PERF_MACOS_XRAY
+[[clang::xray_always_instrument]] __attribute__((noinline)) uint64_t xray_instrumented(uint64_t i) {
+    return 0xABCDEF03 / (i + 1);
+}
+
+void xray_profiler() {
+    const uint64_t n = 1000000;
+
+    // Installs the xray handler. Functions stay unpatched (NOP sleds) until patched
+    Perf::XRayProfiler profiler;
+
+    // Patch all functions matching a pattern and run the code to profile
+    profiler.patch("xray_instrumented");
+    for (uint64_t i = 0; i < n; i++) {
+        const auto val = xray_instrumented(i);
+        DoNotEliminate(val);
+    }
+
+    // Unpatching reduces cost back to a few NOPs
+    profiler.unpatch_all();
+
+    for (const auto &profile : profiler.results()) {
+        std::cout << profile.name << " (" << profile.calls << " calls)" << std::endl;
+        profile.total.averaged(profile.calls).pretty_print();
+    }
+}
+#endif
+
 int main() {
     basic_usage();
     block_counter();
+    pause_resume();
+    laps();
+    user_kernel_split();
+    memory_level_parallelism();
+    memory_stalls();
+    autotuner();
+    selector();
+    threshold_capture();
+    runtime_toggles();
+    async_writer();
+    instruction_mix();
+    mca();
+    alignment_sweep();
+    layout_randomization();
+    instruction_benchmark();
+    roofline();
+    vectorization();
+    distribution();
+    measurement_log();
+    measurement_log_rotation();
+    counter_series();
+    query();
+    aggregator();
+#ifdef PERF_MACOS_XRAY
+    xray_profiler();
+#endif
 
     return 0;
 }
\ No newline at end of file